@@ -0,0 +1,48 @@
+/*
+
+  Copyright 2013 Eric Messick (FixedImagePhoto.com/Contact)
+
+  Heap allocation counter for the COUNT_ALLOCS debug build
+
+  Linked into shuttlepro-allocs only.  These replace the C library's
+  malloc() family for the whole process, Xlib included, and count every
+  allocation before passing it on to glibc's own versions.  The event
+  handling code compares alloc_count before and after each event.
+
+ */
+
+#include "shuttle.h"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+unsigned long alloc_count = 0;
+
+void *
+malloc(size_t size)
+{
+  __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *
+calloc(size_t count, size_t size)
+{
+  __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(count, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+  __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+  __libc_free(ptr);
+}
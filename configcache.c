@@ -0,0 +1,409 @@
+
+/*
+
+  Copyright 2013 Eric Messick (FixedImagePhoto.com/Contact)
+
+  Binary cache of the parsed configuration file
+
+  After the config file has been parsed, the resulting translation
+  sections are written to a binary file next to it (~/.shuttlerc.cache
+  by default).  On later starts and reloads, if the cache was made from
+  a source file with the same modification time, size and contents
+  hash, the sections are rebuilt from the cache without tokenizing the
+  text or looking up KeySym names.  The cache is mmap()ed only to read
+  it: the names, patterns and strokes are copied out into the heap like
+  freshly parsed ones, and the mapping is dropped, so nothing is shared
+  between running instances.
+
+  Configs which include other files aren't cached this way; the
+  included files are cached in memory instead, one by one.
+
+  The cache is only an optimization.  Any problem reading or writing it
+  just means the text file gets parsed as before.  It is written in the
+  native byte order, so it shouldn't be shared between machines.
+
+  Layout: a config_cache_header, then the config_settings, followed by
+  num_sections records of
+
+  u32 name length, name bytes
+  u32 pattern length, pattern bytes (empty for a default section)
+  for each of the CACHE_SLOTS stroke sequences:
+    u32 stroke count, then count triples of (u32 keysym, u32 press,
+    u32 delay)
+  NUM_SHUTTLES scroll rates, as u32
+  u32 chord count, then for each chord:
+    u32 key1, u32 key2, down sequence, up sequence (as above)
+
+ */
+
+#include "shuttle.h"
+
+#include <sys/mman.h>
+
+#define CONFIG_CACHE_MAGIC "SHUTLRC\0"
+#define CONFIG_CACHE_VERSION 11
+
+#define CACHE_FLAG_DEBUG_REGEX 1
+
+// key_down, key_up, shuttle, jog, hold_down, hold_up, double_down and
+// double_up sequences, in that order
+#define CACHE_SLOTS (NUM_KEYS * 6 + NUM_SHUTTLES + NUM_JOGS)
+#define FIRST_GESTURE_SLOT (NUM_KEYS * 2 + NUM_SHUTTLES + NUM_JOGS)
+
+typedef struct _config_cache_header {
+  char magic[8];
+  unsigned int version;
+  unsigned int checksum; // hash of everything following the header
+  long long source_mtime;
+  long long source_size;
+  unsigned int source_hash; // hash of the source file contents
+  unsigned int flags;
+  unsigned int num_sections;
+  unsigned int payload_size;
+} config_cache_header;
+
+extern int debug_regex;
+extern int debug_strokes;
+extern translation *first_translation_section;
+
+stroke **
+translation_slot(translation *tr, int slot)
+{
+  if (slot < NUM_KEYS) {
+    return &tr->key_down[slot];
+  }
+  slot -= NUM_KEYS;
+  if (slot < NUM_KEYS) {
+    return &tr->key_up[slot];
+  }
+  slot -= NUM_KEYS;
+  if (slot < NUM_SHUTTLES) {
+    return &tr->shuttle[slot];
+  }
+  slot -= NUM_SHUTTLES;
+  if (slot < NUM_JOGS) {
+    return &tr->jog[slot];
+  }
+  slot -= NUM_JOGS;
+  if (slot < NUM_KEYS) {
+    return &tr->hold_down[slot];
+  }
+  slot -= NUM_KEYS;
+  if (slot < NUM_KEYS) {
+    return &tr->hold_up[slot];
+  }
+  slot -= NUM_KEYS;
+  if (slot < NUM_KEYS) {
+    return &tr->double_down[slot];
+  }
+  slot -= NUM_KEYS;
+  return &tr->double_up[slot];
+}
+
+char *
+config_cache_name(char *config_name)
+{
+  return alloc_strcat(config_name, ".cache");
+}
+
+// bounds checked reader over the mapped payload
+typedef struct _cache_reader {
+  unsigned char *pos;
+  unsigned char *end;
+  int error;
+} cache_reader;
+
+unsigned int
+read_u32(cache_reader *r)
+{
+  unsigned int v;
+
+  if (r->end - r->pos < 4) {
+    r->error = 1;
+    return 0;
+  }
+  memcpy(&v, r->pos, 4);
+  r->pos += 4;
+  return v;
+}
+
+// returns a newly allocated NUL terminated copy of a counted string
+char *
+read_string(cache_reader *r)
+{
+  unsigned int len = read_u32(r);
+  char *s;
+
+  if (r->error || (unsigned int)(r->end - r->pos) < len) {
+    r->error = 1;
+    return NULL;
+  }
+  s = allocate(len + 1);
+  memcpy(s, r->pos, len);
+  s[len] = '\0';
+  r->pos += len;
+  return s;
+}
+
+stroke *
+read_strokes(cache_reader *r)
+{
+  unsigned int count = read_u32(r);
+  stroke *first = NULL;
+  stroke *last = NULL;
+  stroke *s;
+
+  while (count-- > 0 && !r->error) {
+    s = (stroke *)allocate(sizeof(stroke));
+    s->next = NULL;
+    s->keysym = read_u32(r);
+    s->press = read_u32(r);
+    s->delay = read_u32(r);
+    if (last != NULL) {
+      last->next = s;
+    } else {
+      first = s;
+    }
+    last = s;
+  }
+  return first;
+}
+
+// rebuild the translation sections from the cache.  source_hash is the
+// hash of the source file's current contents.  returns 1 on success.
+// On failure, any sections already built are left for the caller to
+// free.
+int
+load_config_cache(char *config_name, struct stat *st, unsigned int source_hash)
+{
+  char *cache_name = config_cache_name(config_name);
+  config_cache_header *header;
+  struct stat cache_st;
+  cache_reader r;
+  unsigned int i;
+  unsigned int chords;
+  unsigned int key1, key2;
+  chord *c;
+  int slot;
+  void *map = MAP_FAILED;
+  int fd;
+  int ok = 0;
+  char *name;
+  char *pattern;
+  translation *tr;
+
+  fd = open(cache_name, O_RDONLY);
+  free(cache_name);
+  if (fd < 0) {
+    return 0;
+  }
+  if (fstat(fd, &cache_st) == 0 &&
+      cache_st.st_size >= (off_t)sizeof(config_cache_header)) {
+    map = mmap(NULL, cache_st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) {
+    return 0;
+  }
+  header = (config_cache_header *)map;
+  r.pos = (unsigned char *)(header + 1);
+  r.end = (unsigned char *)map + cache_st.st_size;
+  r.error = 0;
+  if (memcmp(header->magic, CONFIG_CACHE_MAGIC, 8) ||
+      header->version != CONFIG_CACHE_VERSION ||
+      header->source_mtime != (long long)st->st_mtime ||
+      header->source_size != (long long)st->st_size ||
+      header->payload_size != (unsigned int)(r.end - r.pos) ||
+      header->payload_size < sizeof(settings) ||
+      header->checksum != hash_bytes(r.pos, r.end - r.pos, HASH_SEED) ||
+      header->source_hash != source_hash) {
+    munmap(map, cache_st.st_size);
+    return 0;
+  }
+
+  memcpy(&settings, r.pos, sizeof(settings));
+  r.pos += sizeof(settings);
+
+  for (i=0; i<header->num_sections && !r.error; i++) {
+    name = read_string(&r);
+    pattern = read_string(&r);
+    if (r.error) {
+      free(name);
+      break;
+    }
+    tr = new_translation_section(name, strlen(name), pattern,
+				 pattern != NULL ? strlen(pattern) : 0);
+    free(name);
+    free(pattern);
+    if (tr == NULL) {
+      r.error = 1;
+      break;
+    }
+    for (slot=0; slot<CACHE_SLOTS && !r.error; slot++) {
+      *translation_slot(tr, slot) = read_strokes(&r);
+      if (*translation_slot(tr, slot) != NULL && slot >= FIRST_GESTURE_SLOT) {
+	tr->gesture_keys |= 1 << ((slot - FIRST_GESTURE_SLOT) % NUM_KEYS);
+      }
+    }
+    for (slot=0; slot<NUM_SHUTTLES; slot++) {
+      tr->scroll_rate[slot] = (int)read_u32(&r);
+    }
+    chords = read_u32(&r);
+    while (chords-- > 0 && !r.error) {
+      key1 = read_u32(&r);
+      key2 = read_u32(&r);
+      if (key1 >= NUM_KEYS || key2 >= NUM_KEYS || key1 == key2 ||
+	  (c = add_chord(tr, key1, key2)) == NULL) {
+	r.error = 1;
+	break;
+      }
+      c->down = read_strokes(&r);
+      c->up = read_strokes(&r);
+    }
+  }
+  if (!r.error && r.pos == r.end) {
+    debug_regex = (header->flags & CACHE_FLAG_DEBUG_REGEX) != 0;
+    ok = 1;
+  }
+  munmap(map, cache_st.st_size);
+  return ok;
+}
+
+// growable buffer the cache is assembled in before writing
+typedef struct _cache_writer {
+  unsigned char *buf;
+  size_t len;
+  size_t size;
+} cache_writer;
+
+void
+write_bytes(cache_writer *w, void *data, size_t len)
+{
+  unsigned char *new_buf;
+
+  if (w->len + len > w->size) {
+    while (w->len + len > w->size) {
+      w->size *= 2;
+    }
+    new_buf = (unsigned char *)allocate(w->size);
+    memcpy(new_buf, w->buf, w->len);
+    free(w->buf);
+    w->buf = new_buf;
+  }
+  memcpy(w->buf + w->len, data, len);
+  w->len += len;
+}
+
+void
+write_u32(cache_writer *w, unsigned int v)
+{
+  write_bytes(w, &v, 4);
+}
+
+void
+write_string(cache_writer *w, char *s)
+{
+  unsigned int len = s ? strlen(s) : 0;
+
+  write_u32(w, len);
+  if (len > 0) {
+    write_bytes(w, s, len);
+  }
+}
+
+void
+write_strokes(cache_writer *w, stroke *s)
+{
+  unsigned int count = 0;
+  stroke *t;
+
+  for (t = s; t != NULL; t = t->next) {
+    count++;
+  }
+  write_u32(w, count);
+  for (t = s; t != NULL; t = t->next) {
+    write_u32(w, (unsigned int)t->keysym);
+    write_u32(w, (unsigned int)t->press);
+    write_u32(w, (unsigned int)t->delay);
+  }
+}
+
+// write the current translation sections to the cache file.  The file
+// is written under a temporary name and renamed into place, so another
+// instance never sees a partial cache.  source_hash is the hash of the
+// text the sections were parsed from.
+void
+write_config_cache(char *config_name, struct stat *st, unsigned int source_hash)
+{
+  config_cache_header header;
+  cache_writer w;
+  translation *tr;
+  chord *c;
+  unsigned int chords;
+  char *cache_name;
+  char *temp_name;
+  char pid[32];
+  int slot;
+  int fd;
+  int ok;
+
+  // stroke debugging output only happens while parsing the text
+  if (debug_strokes) {
+    return;
+  }
+
+  memset(&header, 0, sizeof(header));
+  w.size = 4096;
+  w.buf = (unsigned char *)allocate(w.size);
+  w.len = 0;
+  write_bytes(&w, &header, sizeof(header));
+  write_bytes(&w, &settings, sizeof(settings));
+  for (tr = first_translation_section; tr != NULL; tr = tr->next) {
+    write_string(&w, tr->name);
+    write_string(&w, tr->pattern);
+    for (slot=0; slot<CACHE_SLOTS; slot++) {
+      write_strokes(&w, *translation_slot(tr, slot));
+    }
+    for (slot=0; slot<NUM_SHUTTLES; slot++) {
+      write_u32(&w, (unsigned int)tr->scroll_rate[slot]);
+    }
+    chords = 0;
+    for (c = tr->chords; c != NULL; c = c->next) {
+      chords++;
+    }
+    write_u32(&w, chords);
+    for (c = tr->chords; c != NULL; c = c->next) {
+      write_u32(&w, c->key1);
+      write_u32(&w, c->key2);
+      write_strokes(&w, c->down);
+      write_strokes(&w, c->up);
+    }
+    header.num_sections++;
+  }
+
+  memcpy(header.magic, CONFIG_CACHE_MAGIC, 8);
+  header.version = CONFIG_CACHE_VERSION;
+  header.source_mtime = st->st_mtime;
+  header.source_size = st->st_size;
+  header.source_hash = source_hash;
+  header.flags = debug_regex ? CACHE_FLAG_DEBUG_REGEX : 0;
+  header.payload_size = w.len - sizeof(header);
+  header.checksum = hash_bytes(w.buf + sizeof(header), header.payload_size,
+			       HASH_SEED);
+  memcpy(w.buf, &header, sizeof(header));
+
+  cache_name = config_cache_name(config_name);
+  snprintf(pid, sizeof(pid), ".%d", (int)getpid());
+  temp_name = alloc_strcat(cache_name, pid);
+  fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0) {
+    ok = write(fd, w.buf, w.len) == (ssize_t)w.len;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(temp_name, cache_name) < 0) {
+      unlink(temp_name);
+    }
+  }
+  free(temp_name);
+  free(cache_name);
+  free(w.buf);
+}
@@ -0,0 +1,111 @@
+/*
+
+  Copyright 2013 Eric Messick (FixedImagePhoto.com/Contact)
+
+  Raw HID reports from /dev/hidrawN
+
+  The input layer's mapping of the ShuttlePRO drops the shuttle's
+  center position and a jog value of 0, which is why jog() has to guess
+  when the shuttle has come back to rest.  The device's own HID reports
+  carry the whole state every time anything changes:
+
+  byte 0: shuttle position, -7 .. 7 as a signed byte
+  byte 1: jog counter, 0 .. 255
+  byte 2: unused
+  byte 3: K1 .. K8, one bit each, K1 in bit 0
+  byte 4: K9 .. K15
+
+  Given a hidraw device instead of an event device, the reader thread
+  reads these reports and turns the differences from the last one into
+  the same events the input layer would send, except that shuttle 0
+  and jog 0 show up like any other value.
+
+ */
+
+#include "shuttle.h"
+
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+
+#define SHUTTLE_VENDOR 0x0b33
+#define SHUTTLEPRO_V2_PRODUCT 0x0030
+
+int hidraw_device = 0; // reading HID reports rather than input events
+
+static int last_jog = -1; // -1 until the first report
+static int last_shuttle = 0;
+static unsigned int last_buttons = 0;
+
+// forget the last report, so the next is taken as the first
+void
+reset_hid_decoder(void)
+{
+  last_jog = -1;
+  last_shuttle = 0;
+  last_buttons = 0;
+}
+
+// returns 1 if fd is a ShuttlePRO hidraw device, 0 if it isn't hidraw,
+// and -1 if it is some other hidraw device, whose reports would be
+// decoded as garbage
+int
+is_hidraw(int fd)
+{
+  struct hidraw_devinfo info;
+
+  if (ioctl(fd, HIDIOCGRAWINFO, &info) < 0) {
+    return 0;
+  }
+  if ((unsigned short)info.vendor != SHUTTLE_VENDOR ||
+      (unsigned short)info.product != SHUTTLEPRO_V2_PRODUCT) {
+    fprintf(stderr, "hidraw device %04x:%04x is not a ShuttlePRO v2\n",
+	    (unsigned short)info.vendor, (unsigned short)info.product);
+    return -1;
+  }
+  reset_hid_decoder();
+  return 1;
+}
+
+void
+hid_event(struct input_event *ev, int type, int code, int value)
+{
+  memset(ev, 0, sizeof(*ev));
+  ev->type = type;
+  ev->code = code;
+  ev->value = value;
+}
+
+// fill events with what changed since the last report.  events needs
+// room for MAX_HID_EVENTS.  returns the count, or -1 if the report is
+// too short.
+int
+decode_hid_report(unsigned char *report, int len, struct input_event *events)
+{
+  int shuttle = (signed char)report[0];
+  unsigned int buttons;
+  unsigned int changed;
+  int count = 0;
+  int k;
+
+  if (len < 5) {
+    return -1;
+  }
+  buttons = report[3] | (report[4] << 8);
+  changed = buttons ^ last_buttons;
+  for (k=0; k<NUM_KEYS; k++) {
+    if (changed & (1 << k)) {
+      hid_event(&events[count++], EVENT_TYPE_KEY, EVENT_CODE_KEY1 + k,
+		(buttons >> k) & 1);
+    }
+  }
+  if (shuttle != last_shuttle) {
+    hid_event(&events[count++], EVENT_TYPE_JOGSHUTTLE, EVENT_CODE_SHUTTLE, shuttle);
+  }
+  if (report[1] != last_jog) {
+    hid_event(&events[count++], EVENT_TYPE_JOGSHUTTLE, EVENT_CODE_JOG, report[1]);
+  }
+  last_buttons = buttons;
+  last_shuttle = shuttle;
+  last_jog = report[1];
+  return count;
+}
@@ -0,0 +1,485 @@
+/*
+
+ Jog decoder stress and correctness benchmark
+
+ Copyright 2013 Eric Messick (FixedImagePhoto.com/Contact)
+
+ Runs synthetic jog spins through three decoders and counts how many
+ steps each gets wrong:
+
+ legacy    the loop jog() used to have: the shorter way round, with
+           the step out of position 0 not sent
+ shortest  decode_jog() without timestamps
+ timed     decode_jog() with timestamps, as shuttlepro uses it with
+           JOG_TIMED
+
+ usage: jogbench [TRACE...]
+
+ Each trial starts the wheel at one of the 256 positions and spins it
+ a few detents to get going, then keeps spinning in the same
+ direction with only every DELTA'th position delivered, as when queued
+ events are merged.  Every start position is tried with every DELTA
+ from 1 to 255, both ways, at several spin rates, through two kinds of
+ device:
+
+ evdev     the input layer, which never reports position 0
+ hidraw    which reports every position
+
+ For each, the steps lost (decoded short of the real movement in the
+ right direction) and the direction errors (trials decoded as turning
+ the wrong way) are printed, in total and by DELTA range.
+
+ Then each start position is tried with a flick of a few detents at
+ each spin rate, a pause, and one move back the other way, which
+ must be decoded as the move back.  A prediction from the flick which
+ outlasts the pause would take it the long way round.
+
+ Given recorded traces (see replay.c for the format), the jog events
+ in them are also run through each decoder, and the steps decoded
+ are printed.  There's no true movement to compare against, so that
+ only shows where the decoders disagree.
+
+ Last, a fixed sequence of ShuttlePRO HID reports is decoded by
+ hidraw.c, and the events each gives, and the jog steps decode_jog()
+ makes of them, are checked: key presses and releases, the shuttle
+ returning to center, the jog reaching 0, and the jog wrapping round
+ through 0 both ways.
+
+ Exits with status 1 if the timed decoder gets any trial with DELTA
+ below EXACT_DELTA wrong, if the timed or shortest decoder gets any
+ move back after a pause wrong, or if any HID report is decoded
+ wrong.  The trials are right even taking the shorter way round, as a
+ hidden 0 can at most double the jump.
+
+*/
+
+#include "shuttle.h"
+
+#define DECODER_LEGACY 0
+#define DECODER_SHORTEST 1
+#define DECODER_TIMED 2
+#define NUM_DECODERS 3
+
+#define DEVICE_EVDEV 0
+#define DEVICE_HIDRAW 1
+#define NUM_DEVICES 2
+
+static char *decoder_names[NUM_DECODERS] = { "legacy", "shortest", "timed" };
+static char *device_names[NUM_DEVICES] = { "evdev", "hidraw" };
+
+// detents per second
+static int rates[] = { 50, 300, 1000, 3000, 0 };
+
+// spin up with single detents, then this many merged jumps
+#define WARMUP_DETENTS 8
+#define JUMPS 4
+
+// the first delta of each range the results are broken down by
+static int ranges[] = { 1, 2, 32, 64, 128, 192, 256 };
+#define NUM_RANGES 6
+
+// deltas below this must always be decoded exactly
+#define EXACT_DELTA 64
+
+// the flicks, pauses and moves back the reversal trials are made of
+static int flicks[] = { 1, 3, 20, 0 };
+static int pauses_ms[] = { 20, 100, 300, 900, 0 };
+static int moves_back[] = { 1, 3, 10, 60, 0 };
+
+typedef struct _tally {
+  long trials;
+  long steps; // real movement, summed over trials
+  long lost;
+  long direction_errors;
+} tally;
+
+static tally totals[NUM_DEVICES][NUM_DECODERS];
+static tally by_range[NUM_DEVICES][NUM_DECODERS][NUM_RANGES];
+static tally reversals[NUM_DEVICES][NUM_DECODERS];
+
+typedef struct _any_decoder {
+  int kind;
+  int reports_zero;
+  int legacy_value; // for the legacy decoder, -1 before the first event
+  jog_decoder d;
+} any_decoder;
+
+void
+reset_decoder(any_decoder *a, int kind, int reports_zero)
+{
+  a->kind = kind;
+  a->reports_zero = reports_zero;
+  a->legacy_value = -1;
+  reset_jog_decoder(&a->d);
+}
+
+// the steps jog() used to send for an event
+int
+legacy_jog(any_decoder *a, unsigned int value)
+{
+  int sent = 0;
+  int direction;
+
+  value &= 0xff;
+  if (a->legacy_value >= 0) {
+    direction = ((value - a->legacy_value) & 0x80) ? -1 : 1;
+    while ((unsigned int)a->legacy_value != value) {
+      if (a->legacy_value != 0 || a->reports_zero) {
+	sent += direction;
+      }
+      a->legacy_value = (a->legacy_value + direction) & 0xff;
+    }
+  }
+  a->legacy_value = value;
+  return sent;
+}
+
+int
+decode(any_decoder *a, unsigned int value, long long usec, int reports)
+{
+  switch (a->kind) {
+  case DECODER_LEGACY:
+    return legacy_jog(a, value);
+  case DECODER_SHORTEST:
+    return decode_jog(&a->d, value, usec, reports, 0);
+  default:
+    return decode_jog(&a->d, value, usec, reports, 1);
+  }
+}
+
+// deliver the position reached at time usec, merged from reports
+// events, unless the device hides it
+int
+deliver(any_decoder *a, int position, long long usec, int reports, int device)
+{
+  if (device == DEVICE_EVDEV && position == 0) {
+    return 0;
+  }
+  return decode(a, position, usec, reports);
+}
+
+void
+count(tally *t, int real, int decoded)
+{
+  t->trials++;
+  t->steps += real < 0 ? -real : real;
+  if ((real < 0) != (decoded < 0) && decoded != 0) {
+    t->direction_errors++;
+    t->lost += real < 0 ? -real : real;
+  } else if (real > 0 && decoded < real) {
+    t->lost += real - decoded;
+  } else if (real < 0 && decoded > real) {
+    t->lost += decoded - real;
+  }
+}
+
+void
+trial(int device, int kind, int start, int direction, int delta, int rate)
+{
+  any_decoder a;
+  double usec_per_detent = 1e6 / rate;
+  int position = start;
+  int detents = 0;
+  int decoded;
+  int real;
+  int i;
+  int r;
+
+  reset_decoder(&a, kind, device == DEVICE_HIDRAW);
+  deliver(&a, position, 0, 1, device);
+  for (i=0; i<WARMUP_DETENTS; i++) {
+    position = (position + direction) & 0xff;
+    detents++;
+    deliver(&a, position, (long long)(detents * usec_per_detent), 1, device);
+  }
+  decoded = 0;
+  for (i=0; i<JUMPS; i++) {
+    position = (position + direction * delta) & 0xff;
+    detents += delta;
+    decoded += deliver(&a, position, (long long)(detents * usec_per_detent),
+		       delta, device);
+  }
+  // one more detent, or two if the first lands on a hidden 0, so that
+  // a jump to 0 gets counted
+  real = JUMPS * delta;
+  do {
+    position = (position + direction) & 0xff;
+    detents++;
+    real++;
+  } while (device == DEVICE_EVDEV && position == 0);
+  decoded += deliver(&a, position, (long long)(detents * usec_per_detent), 1,
+		     device);
+  real *= direction;
+
+  count(&totals[device][kind], real, decoded);
+  for (r=0; r<NUM_RANGES; r++) {
+    if (delta < ranges[r+1]) {
+      count(&by_range[device][kind][r], real, decoded);
+      break;
+    }
+  }
+}
+
+// flick the wheel, pause, and turn it back
+void
+reversal_trial(int device, int kind, int start, int direction, int flick,
+	       int rate, int pause_ms, int back)
+{
+  any_decoder a;
+  double usec_per_detent = 1e6 / rate;
+  long long usec = 0;
+  int position = start;
+  int real = 0;
+  int i;
+
+  reset_decoder(&a, kind, device == DEVICE_HIDRAW);
+  deliver(&a, position, usec, 1, device);
+  // stop short of a hidden 0, which the move back would have to guess
+  for (i=0; i<flick || (device == DEVICE_EVDEV && position == 0); i++) {
+    position = (position + direction) & 0xff;
+    usec += usec_per_detent;
+    deliver(&a, position, usec, 1, device);
+  }
+  usec += pause_ms * 1000LL;
+  do {
+    position = (position - direction * back) & 0xff;
+    real += back;
+    back = 1;
+  } while (device == DEVICE_EVDEV && position == 0);
+  count(&reversals[device][kind], -direction * real,
+	deliver(&a, position, usec, 1, device));
+}
+
+void
+print_tally(char *label, tally *t)
+{
+  printf("%-28s %9ld %11ld %10ld %8.4f%% %9ld\n", label, t->trials, t->steps,
+	 t->lost, t->steps > 0 ? 100.0 * t->lost / t->steps : 0.0,
+	 t->direction_errors);
+}
+
+// HID reports, in order, with the events decode_hid_report() should
+// make of each, and the jog steps those should decode to
+typedef struct _hid_case {
+  char *what;
+  unsigned char report[5];
+  int len;
+  int count; // events, or -1 for a report to be rejected
+  int events[3][3]; // type, code, value
+  int steps;
+} hid_case;
+
+#define KEY EVENT_TYPE_KEY
+#define WHEEL EVENT_TYPE_JOGSHUTTLE
+
+static hid_case hid_cases[] = {
+  { "first report", { 0, 5, 0, 0, 0 }, 5, 1,
+    { { WHEEL, EVENT_CODE_JOG, 5 } }, 0 },
+  { "no change", { 0, 5, 0, 0, 0 }, 5, 0, { { 0 } }, 0 },
+  { "K1 down", { 0, 5, 0, 0x01, 0 }, 5, 1,
+    { { KEY, EVENT_CODE_KEY1, 1 } }, 0 },
+  { "K1 up, K9 down", { 0, 5, 0, 0, 0x01 }, 5, 2,
+    { { KEY, EVENT_CODE_KEY1, 0 }, { KEY, EVENT_CODE_KEY1 + 8, 1 } }, 0 },
+  { "K9 up, K15 down", { 0, 5, 0, 0, 0x40 }, 5, 2,
+    { { KEY, EVENT_CODE_KEY1 + 8, 0 }, { KEY, EVENT_CODE_KEY1 + 14, 1 } }, 0 },
+  { "K15 up", { 0, 5, 0, 0, 0 }, 5, 1,
+    { { KEY, EVENT_CODE_KEY1 + 14, 0 } }, 0 },
+  { "shuttle right", { 3, 5, 0, 0, 0 }, 5, 1,
+    { { WHEEL, EVENT_CODE_SHUTTLE, 3 } }, 0 },
+  { "shuttle center", { 0, 5, 0, 0, 0 }, 5, 1,
+    { { WHEEL, EVENT_CODE_SHUTTLE, 0 } }, 0 },
+  { "shuttle full left", { 0xf9, 5, 0, 0, 0 }, 5, 1,
+    { { WHEEL, EVENT_CODE_SHUTTLE, -7 } }, 0 },
+  { "jog to 0", { 0xf9, 0, 0, 0, 0 }, 5, 1,
+    { { WHEEL, EVENT_CODE_JOG, 0 } }, -5 },
+  { "jog back past 0", { 0xf9, 254, 0, 0, 0 }, 5, 1,
+    { { WHEEL, EVENT_CODE_JOG, 254 } }, -2 },
+  { "jog forward past 0", { 0xf9, 3, 0, 0, 0 }, 5, 1,
+    { { WHEEL, EVENT_CODE_JOG, 3 } }, 5 },
+  { "all at once", { 0, 4, 0, 0x80, 0 }, 5, 3,
+    { { KEY, EVENT_CODE_KEY1 + 7, 1 }, { WHEEL, EVENT_CODE_SHUTTLE, 0 },
+      { WHEEL, EVENT_CODE_JOG, 4 } }, 1 },
+  { "short report", { 0, 9, 0, 0, 0 }, 4, -1, { { 0 } }, 0 },
+  { "after a short one", { 0, 4, 0, 0, 0 }, 5, 1,
+    { { KEY, EVENT_CODE_KEY1 + 7, 0 } }, 0 },
+};
+
+#define NUM_HID_CASES (int)(sizeof(hid_cases) / sizeof(hid_cases[0]))
+
+// returns the number of reports decoded wrong
+int
+check_hid_reports(void)
+{
+  struct input_event events[MAX_HID_EVENTS];
+  jog_decoder d;
+  hid_case *c;
+  int wrong = 0;
+  int count;
+  int steps;
+  int bad;
+  int i, k;
+
+  reset_hid_decoder();
+  reset_jog_decoder(&d);
+  for (i=0; i<NUM_HID_CASES; i++) {
+    c = &hid_cases[i];
+    count = decode_hid_report(c->report, c->len, events);
+    bad = count != c->count;
+    steps = 0;
+    for (k=0; !bad && k<count; k++) {
+      bad = events[k].type != c->events[k][0] || events[k].code != c->events[k][1] ||
+	events[k].value != c->events[k][2];
+      if (events[k].type == EVENT_TYPE_JOGSHUTTLE && events[k].code == EVENT_CODE_JOG) {
+	steps += decode_jog(&d, events[k].value, i * 10000LL, 1, 0);
+      }
+    }
+    if (!bad && steps != c->steps) {
+      bad = 1;
+    }
+    if (bad) {
+      fprintf(stderr, "hid report \"%s\" decoded wrong: %d events,", c->what, count);
+      for (k=0; k<count; k++) {
+	fprintf(stderr, " (%d, %d, %d)", events[k].type, events[k].code, events[k].value);
+      }
+      fprintf(stderr, " %d jog steps\n", steps);
+      wrong++;
+    }
+  }
+  printf("\nhid reports: %d decoded, %d wrong\n", NUM_HID_CASES, wrong);
+  return wrong;
+}
+
+// run the jog events of a recorded trace through each decoder
+void
+replay_trace(char *file_name)
+{
+  FILE *f = fopen(file_name, "r");
+  char line[1024];
+  any_decoder a[NUM_DECODERS];
+  long steps[NUM_DECODERS];
+  long long usec;
+  unsigned int type, code;
+  int value;
+  int events = 0;
+  int k;
+
+  if (f == NULL) {
+    perror(file_name);
+    exit(1);
+  }
+  for (k=0; k<NUM_DECODERS; k++) {
+    reset_decoder(&a[k], k, 0);
+    steps[k] = 0;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "%lld %u %u %d", &usec, &type, &code, &value) == 4 &&
+	type == EVENT_TYPE_JOGSHUTTLE && code == EVENT_CODE_JOG) {
+      events++;
+      for (k=0; k<NUM_DECODERS; k++) {
+	steps[k] += decode(&a[k], value, usec, 1);
+      }
+    }
+  }
+  fclose(f);
+  printf("%-32s %8d %10ld %10ld %10ld\n", file_name, events, steps[DECODER_LEGACY],
+	 steps[DECODER_SHORTEST], steps[DECODER_TIMED]);
+}
+
+int
+main(int argc, char **argv)
+{
+  char label[64];
+  int device, kind;
+  int start, direction, delta;
+  int i, r;
+  long must_be_right = 0;
+  long reversal_errors = 0;
+  int hid_wrong;
+  int f, p, b;
+
+  for (i=0; rates[i] != 0; i++) {
+    for (device=0; device<NUM_DEVICES; device++) {
+      for (kind=0; kind<NUM_DECODERS; kind++) {
+	for (start=0; start<256; start++) {
+	  for (delta=1; delta<256; delta++) {
+	    for (direction=-1; direction<=1; direction+=2) {
+	      trial(device, kind, start, direction, delta, rates[i]);
+	    }
+	  }
+	}
+      }
+    }
+  }
+
+  for (i=0; rates[i] != 0; i++) {
+    for (device=0; device<NUM_DEVICES; device++) {
+      for (kind=0; kind<NUM_DECODERS; kind++) {
+	for (start=0; start<256; start++) {
+	  for (direction=-1; direction<=1; direction+=2) {
+	    for (f=0; flicks[f] != 0; f++) {
+	      for (p=0; pauses_ms[p] != 0; p++) {
+		for (b=0; moves_back[b] != 0; b++) {
+		  reversal_trial(device, kind, start, direction, flicks[f], rates[i],
+				 pauses_ms[p], moves_back[b]);
+		}
+	      }
+	    }
+	  }
+	}
+      }
+    }
+  }
+
+  printf("%-28s %9s %11s %10s %9s %9s\n", "device/decoder", "trials", "steps",
+	 "lost", "lost", "dir errs");
+  for (device=0; device<NUM_DEVICES; device++) {
+    for (kind=0; kind<NUM_DECODERS; kind++) {
+      sprintf(label, "%s/%s", device_names[device], decoder_names[kind]);
+      print_tally(label, &totals[device][kind]);
+    }
+  }
+  printf("\nby delta between delivered positions:\n");
+  for (device=0; device<NUM_DEVICES; device++) {
+    for (kind=0; kind<NUM_DECODERS; kind++) {
+      for (r=0; r<NUM_RANGES; r++) {
+	sprintf(label, "%s/%s %d-%d", device_names[device], decoder_names[kind],
+		ranges[r], ranges[r+1] - 1);
+	print_tally(label, &by_range[device][kind][r]);
+	if (kind == DECODER_TIMED && ranges[r+1] <= EXACT_DELTA) {
+	  must_be_right += by_range[device][kind][r].lost +
+	    by_range[device][kind][r].direction_errors;
+	}
+      }
+    }
+  }
+
+  printf("\nmoving back after a flick and a pause:\n");
+  for (device=0; device<NUM_DEVICES; device++) {
+    for (kind=0; kind<NUM_DECODERS; kind++) {
+      sprintf(label, "%s/%s", device_names[device], decoder_names[kind]);
+      print_tally(label, &reversals[device][kind]);
+      if (kind != DECODER_LEGACY) {
+	reversal_errors += reversals[device][kind].lost +
+	  reversals[device][kind].direction_errors;
+      }
+    }
+  }
+
+  if (argc > 1) {
+    printf("\n%-32s %8s %10s %10s %10s\n", "trace", "jog evs", "legacy",
+	   "shortest", "timed");
+    for (i=1; i<argc; i++) {
+      replay_trace(argv[i]);
+    }
+  }
+  hid_wrong = check_hid_reports();
+  if (must_be_right != 0) {
+    fprintf(stderr, "timed decoder lost steps on deltas below %d\n", EXACT_DELTA);
+    return 1;
+  }
+  if (reversal_errors != 0) {
+    fprintf(stderr, "a move back after a pause was decoded wrong\n");
+    return 1;
+  }
+  return hid_wrong != 0;
+}
@@ -0,0 +1,120 @@
+/*
+
+  Copyright 2013 Eric Messick (FixedImagePhoto.com/Contact)
+
+  Jog wheel decoding
+
+  The jog wheel reports an 8 bit position, one more or less for each
+  detent, rather than the steps themselves.  The steps are the
+  difference from the last position, but that only says how far the
+  wheel went modulo 256: 200 steps clockwise look the same as 56
+  counter-clockwise.
+
+  Normally the wheel moves a detent or a few between events, and the
+  shorter way round is right.  Bigger jumps happen when events are
+  merged or dropped while output lags, or when the position 0 goes
+  missing, as it does through the input layer.  With timestamps, each
+  move can be taken the way round that's nearer to what the speed the
+  wheel has been turning at predicts, so a fast spin which covers more
+  than half a turn between two events isn't read as a spin the other
+  way.  shuttlepro does that with JOG_TIMED.
+
+  The speed, and the time between the device's reports, are averaged
+  over the last few events, so one quick flick doesn't set the
+  prediction.  The prediction is only used while the wheel is known to
+  have kept moving: for an event which comes within
+  JOG_PREDICT_INTERVALS of the usual time between reports, for each
+  report it stands for.  An event merged from a backlog of N stands
+  for N reports, so a fast spin behind the output is still predicted.
+  A single event after a longer gap is taken the shorter way, as the
+  wheel may have stopped and turned back, and the timing starts again
+  from there.  A prediction also has to be more than half a turn off
+  the shorter way to change anything.
+
+  The decoder knows nothing about X, so jogbench can check it against
+  synthetic spins.
+
+ */
+
+#include "shuttle.h"
+
+// how many events the speed and interval are averaged over
+#define JOG_SMOOTHING 3
+// how many usual intervals after the last event a prediction lasts
+#define JOG_PREDICT_INTERVALS 4
+// a move shorter than this can't be the other way round, even with a
+// hidden 0
+#define JOG_SURE_STEPS 64
+
+void
+reset_jog_decoder(jog_decoder *d)
+{
+  d->value = -1;
+  d->last_usec = 0;
+  d->velocity = 0;
+  d->interval = 0;
+}
+
+// average sample into *estimate, or start it there
+void
+smooth(double *estimate, double sample)
+{
+  if (*estimate == 0) {
+    *estimate = sample;
+  } else {
+    *estimate += (sample - *estimate) / JOG_SMOOTHING;
+  }
+}
+
+// returns the number of steps the wheel moved to reach value at time
+// usec, positive for clockwise.  reports is the number of the device's
+// reports the event was merged from, 1 if it wasn't.  Without use_time,
+// the shorter way round is always taken.
+int
+decode_jog(jog_decoder *d, unsigned int value, long long usec, int reports,
+	   int use_time)
+{
+  long long dt;
+  double predicted;
+  int steps;
+
+  value &= 0xff;
+  if (d->value < 0) {
+    d->value = value;
+    d->last_usec = usec;
+    return 0;
+  }
+  steps = (value - d->value) & 0xff; // clockwise, 0 .. 255
+  if (steps >= 128) {
+    steps -= 256;
+  }
+  dt = usec - d->last_usec;
+  if (reports < 1) {
+    reports = 1;
+  }
+  if (d->interval > 0 && dt > JOG_PREDICT_INTERVALS * d->interval * reports) {
+    // the wheel may have stopped and turned back since the last event,
+    // so start timing it again from this one
+    d->velocity = 0;
+    d->interval = 0;
+  } else if (dt > 0) {
+    if (use_time && d->velocity != 0) {
+      // take the other way round if the prediction is nearer to it
+      predicted = d->velocity * dt;
+      if (steps > 0 && predicted < steps - 128) {
+	steps -= 256;
+      } else if (steps < 0 && predicted > steps + 128) {
+	steps += 256;
+      }
+    }
+    // only a move which is sure to be the shorter way can start the
+    // speed off
+    if (d->velocity != 0 || (steps < JOG_SURE_STEPS && steps > -JOG_SURE_STEPS)) {
+      smooth(&d->velocity, (double)steps / dt);
+    }
+    smooth(&d->interval, (double)dt / reports);
+  }
+  d->value = value;
+  d->last_usec = usec;
+  return steps;
+}
@@ -15,7 +15,33 @@
   J<LR> output
 
   When focus is on a window whose title matches regex, the following
-  translation class is in effect.  An empty regex for the last class
+  translation class is in effect.  Sections are tried in order, and
+  the first match wins.  A regex which is just a plain string, possibly
+  anchored with ^ and/or $, is compared directly rather than through
+  regexec(), and the fully anchored ones, ^title$, are looked up in a
+  hash table, so only the other sections ahead of the one found there
+  are tried in turn.  Other regexes are only compiled the first time a window
+  title has to be checked against them, so errors in them are reported
+  then.
+
+  MAX_COMPILED_REGEX n
+
+  limits the number of compiled regexes kept in memory to n.  Beyond
+  that, the least recently used one is freed, and compiled again if it
+  is needed later.
+
+  Instead of a regex, a section may select windows by application:
+
+  [name] class=value
+  [name] exe=value
+
+  class= matches either part of the window's WM_CLASS exactly, and exe=
+  matches the name of the process owning the window (from _NET_WM_PID),
+  either its comm (truncated to 15 characters by the kernel) or the
+  file name of its executable.  These are looked up in hash tables and
+  take priority over title regexes, which are only tried when no class
+  or exe section applies.  If the same value is given twice, the first
+  section wins.  An empty regex for the last class
   will always match, allowing default translations.  Any output
   sequences not bound in a matched section will be loaded from the
   default section if they are bound there.
@@ -39,6 +65,71 @@
   K4 "V" XK_Left XK_Page_Up "v"
   K5 XK_Alt_L/D "v" XK_Alt_L/U "x" RELEASE "q"
 
+  A delay=<n>ms word in the output waits n milliseconds before the
+  next keystroke (the ms is optional), so it needs one after it.  The
+  daemon keeps handling other ShuttlePRO events while it waits.
+
+  K6 XK_Tab delay=20ms "abc"
+
+  With an XTEST_DELAYS line in the file, the delays are passed to the X
+  server with the XTest requests instead, and the whole sequence is
+  sent at once.
+
+  A shuttle binding may include scroll=<n>, which scrolls continuously
+  at n wheel detents per second while the shuttle is in that position
+  (negative n scrolls up).  Where /dev/uinput can be written, it
+  scrolls in fractions of a detent through a virtual wheel mouse, as
+  described in wheel.c.  Otherwise it sends wheel clicks, carrying
+  partial detents over, so slow rates still come out smooth over time.
+
+  S3 scroll=20
+
+  Keys can also be given extra bindings for gestures:
+
+  K5:hold output      used when K5 is held down for HOLD_TIME ms
+  K5:double output    used when K5 is pressed twice within DOUBLE_TIME ms
+  K5+K6 output        used when K5 and K6 are pressed within CHORD_TIME ms
+
+  These work like ordinary K bindings, including RELEASE.  Only keys
+  which have gesture bindings wait to see which gesture is made; all
+  other keys act as soon as they are pressed.  The times are set with
+
+  HOLD_TIME ms        (default 500)
+  DOUBLE_TIME ms      (default 250)
+  CHORD_TIME ms       (default 50)
+
+  and DEBUG_GESTURES prints each gesture recognized and how long it
+  took to decide.
+
+  If X output falls behind, ShuttlePRO events queue up.  When they are
+  caught up on, a run of queued jog events is handled as one move to
+  the last jog position, and a run of shuttle events as just the last
+  shuttle position, so the jog doesn't keep scrubbing after it has
+  stopped.  NO_COALESCE turns that off, and
+
+  EVENT_DEADLINE ms
+
+  drops jog events which have been queued for longer than that.  Key
+  events are never dropped.  However many steps a merged jog move
+  adds up to, no more than
+
+  JOG_MAX_STEPS n     (default 16)
+
+  of them are sent.  DEBUG_EVENTS prints counts of the merged and
+  dropped events and steps.
+
+  A move of the jog wheel between two events is taken the shorter way
+  round.  With JOG_TIMED, a move which comes soon after the last one
+  is instead taken the way round which best fits the speed the wheel
+  has been turning at, so a fast spin which gets more than half a turn
+  ahead of the output isn't read as a spin the other way.  See
+  jogdecode.c.
+
+  TRACE_THRESHOLD ms
+
+  writes out the recent hot path trace (see trace.c) when an event
+  takes longer than that from the device to the end of its handling.
+
   Any keycode can be followed by an optional /D, /U, or /H, indicating
   that the key is just going down (without being released), going up,
   or going down and being held until the shuttlepro key is released.
@@ -51,6 +142,27 @@
   At the end of shuttle and jog sequences, all down keys will be
   released.
 
+  Sequences used in many places can be named with a MACRO line, and
+  then used in any binding as @name:
+
+  MACRO undo XK_Control_L/D "z"
+  K1 @undo
+
+  Identical sequences are only stored once, however they were written.
+  Macros only apply within the file they're defined in.
+
+  include file
+  include_dir directory
+
+  reads the sections from another file, or from each file in a
+  directory in name order, as if they appeared at that point.  Names
+  are relative to the directory of the file containing the line.  An
+  included file starts with no section, and the including file needs a
+  new [name] line before any more bindings.  Settings like HOLD_TIME
+  only work in the main file.  When the config is reloaded, only the
+  files which have actually changed are parsed again, several at a
+  time on machines with more than one CPU.
+
   Keypresses translate to separate press and release sequences.
 
   At the end of the press sequence for key sequences, all down keys
@@ -65,8 +177,14 @@
 
 #include "shuttle.h"
 
+#include <stdarg.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
 int debug_regex = 0;
 int debug_strokes = 0;
+config_settings settings;
 
 char *
 allocate(size_t len)
@@ -102,88 +220,289 @@ alloc_strcat(char *a, char *b)
   return result;
 }
 
-static char *read_line_buffer = NULL;
-static int read_line_buffer_length = 0;
+// copy len bytes of s into a new NUL terminated string
+char *
+alloc_strndup(char *s, size_t len)
+{
+  char *result = allocate(len+1);
 
-#define BUF_GROWTH_STEP 1024
+  memcpy(result, s, len);
+  result[len] = '\0';
+  return result;
+}
 
+// FNV-1a hash of a block of memory, continuing from hash
+unsigned int
+hash_bytes(void *data, size_t len, unsigned int hash)
+{
+  unsigned char *p = (unsigned char *)data;
 
-// read a line of text from the given file into a managed buffer.
-// returns a partial line at EOF if the file does not end with \n.
-// exits with error message on read error.
-char *
-read_line(FILE *f, char *name)
+  while (len-- > 0) {
+    hash ^= *p++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// FNV-1a hash of a string, used for the window title cache and
+// the class= and exe= section tables
+unsigned int
+hash_string(char *str)
 {
-  int pos = 0;
-  char *new_buffer;
-  int new_buffer_length;
+  unsigned int hash = HASH_SEED;
 
-  if (read_line_buffer == NULL) {
-    read_line_buffer_length = BUF_GROWTH_STEP;
-    read_line_buffer = allocate(read_line_buffer_length);
-    read_line_buffer[0] = '\0';
+  while (*str) {
+    hash ^= (unsigned char)*str++;
+    hash *= 16777619u;
   }
+  return hash;
+}
 
-  while (1) {
-    read_line_buffer[read_line_buffer_length-1] = '\377';
-    if (fgets(read_line_buffer+pos, read_line_buffer_length-pos, f) == NULL) {
-      if (feof(f)) {
-	if (pos > 0) {
-	  // partial line at EOF
-	  return read_line_buffer;
-	} else {
-	  return NULL;
-	}
-      }
-      perror(name);
-      exit(1);
+translation *first_translation_section = NULL;
+static translation *last_translation_section = NULL;
+
+translation *default_translation;
+
+// characters which make a basic regular expression more than a plain
+// string.  Some of these are only special in extended regexes, but we
+// stay on the safe side.
+#define REGEX_SPECIAL_CHARS ".[]\\*^$+?{}()|"
+
+// decide whether the pattern can be matched without regexec().  If it
+// can, the literal part of the pattern is copied into tr->literal.
+// returns the MATCH_* type.
+int
+classify_pattern(translation *tr, char *regex)
+{
+  int anchored = 0;
+  size_t len;
+
+  if (*regex == '^') {
+    anchored = 1;
+    regex++;
+  }
+  len = strcspn(regex, REGEX_SPECIAL_CHARS);
+  if (regex[len] == '$' && regex[len+1] == '\0') {
+    if (!anchored) {
+      return MATCH_REGEX;
+    }
+    tr->match_type = MATCH_EXACT;
+  } else if (regex[len] != '\0') {
+    return MATCH_REGEX;
+  } else {
+    tr->match_type = anchored ? MATCH_PREFIX : MATCH_SUBSTRING;
+  }
+  tr->literal = allocate(len+1);
+  memcpy(tr->literal, regex, len);
+  tr->literal[len] = '\0';
+  tr->literal_len = len;
+  return tr->match_type;
+}
+
+// hash tables for class= and exe= sections, and for ^title$ ones,
+// chained through hash_next
+#define SECTION_HASH_SIZE 256
+
+static translation *class_sections[SECTION_HASH_SIZE];
+static translation *exe_sections[SECTION_HASH_SIZE];
+static translation *exact_sections[SECTION_HASH_SIZE];
+int have_class_sections = 0;
+int have_exe_sections = 0;
+
+// the default section and those with prefix, substring and regex
+// patterns, which have to be tried against a title one by one
+static translation *first_scan_section = NULL;
+static translation *last_scan_section = NULL;
+static int linked_sections = 0;
+
+void
+add_section_hash(translation **table, translation *tr)
+{
+  translation **bucket = &table[hash_string(tr->literal) % SECTION_HASH_SIZE];
+  translation *t;
+
+  for (t = *bucket; t != NULL; t = t->hash_next) {
+    if (!strcmp(t->literal, tr->literal)) {
+      return; // first definition wins
     }
-    if (read_line_buffer[read_line_buffer_length-1] != '\0') {
-      return read_line_buffer;
+  }
+  tr->hash_next = *bucket;
+  *bucket = tr;
+}
+
+translation *
+lookup_section_hash(translation **table, char *value)
+{
+  translation *t;
+
+  if (value == NULL) {
+    return NULL;
+  }
+  t = table[hash_string(value) % SECTION_HASH_SIZE];
+  while (t != NULL && strcmp(t->literal, value)) {
+    t = t->hash_next;
+  }
+  return t;
+}
+
+// recognize class=value and exe=value section patterns
+int
+classify_application(translation *tr, char *pattern)
+{
+  char *value;
+
+  if (!strncmp(pattern, "class=", 6)) {
+    tr->match_type = MATCH_CLASS;
+    value = pattern + 6;
+  } else if (!strncmp(pattern, "exe=", 4)) {
+    tr->match_type = MATCH_EXE;
+    value = pattern + 4;
+  } else {
+    return MATCH_REGEX;
+  }
+  tr->literal = alloc_strcat(value, NULL);
+  tr->literal_len = strlen(value);
+  return tr->match_type;
+}
+
+// Sections are created by parsing or by loading the cache, and belong
+// to the config fragment they came from.  Once all of the fragments
+// are loaded, their sections are linked together in include order,
+// and the class= and exe= tables are rebuilt from them.
+
+void
+unlink_all_translations(void)
+{
+  first_translation_section = NULL;
+  last_translation_section = NULL;
+  default_translation = NULL;
+  memset(class_sections, 0, sizeof(class_sections));
+  memset(exe_sections, 0, sizeof(exe_sections));
+  memset(exact_sections, 0, sizeof(exact_sections));
+  have_class_sections = 0;
+  have_exe_sections = 0;
+  first_scan_section = NULL;
+  last_scan_section = NULL;
+  linked_sections = 0;
+  stat_set(STAT_SECTIONS, 0);
+}
+
+void
+link_translation_section(translation *tr)
+{
+  tr->next = NULL;
+  tr->hash_next = NULL;
+  tr->scan_next = NULL;
+  tr->order = linked_sections++;
+  if (first_translation_section == NULL) {
+    first_translation_section = tr;
+  } else {
+    last_translation_section->next = tr;
+  }
+  last_translation_section = tr;
+  stat_set(STAT_SECTIONS, linked_sections);
+  if (tr->match_type == MATCH_CLASS && !tr->is_default) {
+    add_section_hash(class_sections, tr);
+    have_class_sections = 1;
+  } else if (tr->match_type == MATCH_EXE && !tr->is_default) {
+    add_section_hash(exe_sections, tr);
+    have_exe_sections = 1;
+  } else if (tr->match_type == MATCH_EXACT && !tr->is_default) {
+    // the first section for a title comes first in the scan order too
+    add_section_hash(exact_sections, tr);
+  } else {
+    if (tr->is_default) {
+      default_translation = tr;
     }
-    if (read_line_buffer[read_line_buffer_length-2] == '\n') {
-      return read_line_buffer;
+    if (first_scan_section == NULL) {
+      first_scan_section = tr;
+    } else {
+      last_scan_section->scan_next = tr;
     }
-    new_buffer_length = read_line_buffer_length + BUF_GROWTH_STEP;
-    new_buffer = allocate(new_buffer_length);
-    memcpy(new_buffer, read_line_buffer, read_line_buffer_length);
-    free(read_line_buffer);
-    pos = read_line_buffer_length-1;
-    read_line_buffer = new_buffer;
-    read_line_buffer_length = new_buffer_length;
+    last_scan_section = tr;
   }
 }
 
-static translation *first_translation_section = NULL;
-static translation *last_translation_section = NULL;
+// a config file, and what was parsed from it: its sections and include
+// lines, in the order they appeared
+typedef struct _fragment_item {
+  struct _fragment_item *next;
+  translation *section; // NULL for an include
+  char *include; // file or directory name
+  int is_dir;
+  char **dir_files; // what was in the directory at the last reload
+  int dir_count;
+} fragment_item;
+
+typedef struct _fragment {
+  struct _fragment *hash_next;
+  char *file_name;
+  struct stat st;
+  unsigned int hash; // of the contents
+  int has_contents; // st, hash and items are from an earlier load
+  int is_main;
+  int loaded; // queued for loading during this reload
+  int ok; // readable this time
+  int parsed; // parsed from text during this reload
+  int linked; // reached while linking the current config
+  int has_includes;
+  fragment_item *items;
+  fragment_item **items_tail;
+  // from the directives in the main file
+  config_settings settings;
+  int debug_regex;
+  int debug_strokes;
+} fragment;
+
+// the fragment being parsed or loaded from the cache, which gets the
+// new sections
+static __thread fragment *loading_fragment = NULL;
 
-translation *default_translation;
+void
+add_fragment_item(fragment *f, translation *section, char *include, int is_dir)
+{
+  fragment_item *item = (fragment_item *)allocate(sizeof(fragment_item));
+
+  item->next = NULL;
+  item->section = section;
+  item->include = include;
+  item->is_dir = is_dir;
+  item->dir_files = NULL;
+  item->dir_count = 0;
+  *f->items_tail = item;
+  f->items_tail = &item->next;
+  if (include != NULL) {
+    f->has_includes = 1;
+  }
+}
 
+// regex may be NULL, meaning there was nothing after the name
 translation *
-new_translation_section(char *name, char *regex)
+new_translation_section(char *name, size_t name_len, char *regex, size_t regex_len)
 {
   translation *ret = (translation *)allocate(sizeof(translation));
-  int err;
   int i;
 
   if (debug_strokes) {
-    printf("------------------------\n[%s] %s\n\n", name, regex);
+    printf("------------------------\n[%.*s] %.*s\n\n", (int)name_len, name,
+	   (int)regex_len, regex != NULL ? regex : "");
   }
   ret->next = NULL;
-  ret->name = alloc_strcat(name, NULL);
-  if (regex == NULL || *regex == '\0') {
+  ret->hash_next = NULL;
+  ret->name = alloc_strndup(name, name_len);
+  ret->pattern = NULL;
+  ret->match_type = MATCH_REGEX;
+  ret->literal = NULL;
+  ret->literal_len = 0;
+  ret->regex_state = REGEX_UNCOMPILED;
+  ret->regex_last_used = 0;
+  if (regex == NULL || regex_len == 0) {
     ret->is_default = 1;
-    default_translation = ret;
   } else {
     ret->is_default = 0;
-    err = regcomp(&ret->regex, regex, REG_NOSUB);
-    if (err != 0) {
-      regerror(err, &ret->regex, read_line_buffer, read_line_buffer_length);
-      fprintf(stderr, "error compiling regex for [%s]: %s\n", name, read_line_buffer);
-      regfree(&ret->regex);
-      free(ret->name);
-      free(ret);
-      return NULL;
+    ret->pattern = alloc_strndup(regex, regex_len);
+    if (classify_application(ret, ret->pattern) == MATCH_REGEX) {
+      classify_pattern(ret, ret->pattern);
     }
   }
   for (i=0; i<NUM_KEYS; i++) {
@@ -192,17 +511,20 @@ new_translation_section(char *name, char *regex)
   }
   for (i=0; i<NUM_SHUTTLES; i++) {
     ret->shuttle[i] = NULL;
+    ret->scroll_rate[i] = 0;
   }
   for (i=0; i<NUM_JOGS; i++) {
     ret->jog[i] = NULL;
   }
-  if (first_translation_section == NULL) {
-    first_translation_section = ret;
-    last_translation_section = ret;
-  } else {
-    last_translation_section->next = ret;
-    last_translation_section = ret;
+  for (i=0; i<NUM_KEYS; i++) {
+    ret->hold_down[i] = NULL;
+    ret->hold_up[i] = NULL;
+    ret->double_down[i] = NULL;
+    ret->double_up[i] = NULL;
   }
+  ret->chords = NULL;
+  ret->gesture_keys = 0;
+  add_fragment_item(loading_fragment, ret, NULL, 0);
   return ret;
 }
 
@@ -217,251 +539,741 @@ free_strokes(stroke *s)
   }
 }
 
-void
-free_translation_section(translation *tr)
+// Identical stroke sequences are shared by all the bindings which use
+// them, so a config binding the same keys in many sections keeps one
+// copy of each.  The sequences belong to this table rather than to the
+// translations.  After a reload, the ones no longer used by any linked
+// section are swept out.
+typedef struct _interned_strokes {
+  struct _interned_strokes *next;
+  unsigned int hash;
+  int used;
+  stroke *strokes;
+} interned_strokes;
+
+static interned_strokes **interned = NULL;
+static unsigned int interned_size = 0; // number of buckets
+static unsigned int interned_count = 0;
+unsigned long interned_shared = 0; // bindings which reused a sequence
+
+unsigned int
+hash_strokes(stroke *s)
 {
-  int i;
+  unsigned int hash = HASH_SEED;
 
-  if (tr != NULL) {
-    free(tr->name);
-    if (!tr->is_default) {
-      regfree(&tr->regex);
-    }
-    for (i=0; i<NUM_KEYS; i++) {
-      free_strokes(tr->key_down[i]);
-      free_strokes(tr->key_up[i]);
-    }
-    for (i=0; i<NUM_SHUTTLES; i++) {
-      free_strokes(tr->shuttle[i]);
-    }
-    for (i=0; i<NUM_JOGS; i++) {
-      free_strokes(tr->jog[i]);
+  for (; s != NULL; s = s->next) {
+    hash = hash_bytes(&s->keysym, sizeof(s->keysym), hash);
+    hash = hash_bytes(&s->press, sizeof(s->press), hash);
+    hash = hash_bytes(&s->delay, sizeof(s->delay), hash);
+  }
+  return hash;
+}
+
+int
+same_strokes(stroke *a, stroke *b)
+{
+  while (a != NULL && b != NULL) {
+    if (a->keysym != b->keysym || a->press != b->press || a->delay != b->delay) {
+      return 0;
     }
-    free(tr);
+    a = a->next;
+    b = b->next;
   }
+  return a == b;
 }
 
 void
-free_all_translations(void)
+grow_interned(void)
 {
-  translation *tr = first_translation_section;
-  translation *next;
-
-  while (tr != NULL) {
-    next = tr->next;
-    free_translation_section(tr);
-    tr = next;
+  unsigned int new_size = interned_size ? interned_size * 2 : 256;
+  interned_strokes **new_table;
+  interned_strokes *e;
+  unsigned int i;
+
+  new_table = (interned_strokes **)allocate(new_size * sizeof(*new_table));
+  memset(new_table, 0, new_size * sizeof(*new_table));
+  for (i=0; i<interned_size; i++) {
+    while ((e = interned[i]) != NULL) {
+      interned[i] = e->next;
+      e->next = new_table[e->hash % new_size];
+      new_table[e->hash % new_size] = e;
+    }
   }
-  first_translation_section = NULL;
-  last_translation_section = NULL;
+  free(interned);
+  interned = new_table;
+  interned_size = new_size;
 }
 
-static char *config_file_name = NULL;
-static time_t config_file_modification_time;
-
-static char *token_src = NULL;
-
-// similar to strtok, but it tells us what delimiter was found at the
-// end of the token, handles double quoted strings specially, and
-// hardcodes the delimiter set.
-char *
-token(char *src, char *delim_found)
+// returns the shared copy of the sequence, freeing s if there already
+// was one
+stroke *
+intern_strokes(stroke *s)
 {
-  char *delims = " \t\n/\"";
-  char *d;
-  char *token_start;
+  unsigned int hash;
+  interned_strokes *e;
 
-  if (src == NULL) {
-    src = token_src;
-  }
-  if (src == NULL) {
-    *delim_found = '\0';
+  if (s == NULL) {
     return NULL;
   }
-  token_start = src;
-  while (*src) {
-    d = delims;
-    while (*d && *src != *d) {
-      d++;
-    }
-    if (*d) {
-      if (src == token_start) {
-	src++;
-	token_start = src;
-	if (*d == '"') {
-	  while (*src && *src != '"' && *src != '\n') {
-	    src++;
-	  }
-	} else {
-	  continue;
-	}
+  hash = hash_strokes(s);
+  if (interned_size > 0) {
+    for (e = interned[hash % interned_size]; e != NULL; e = e->next) {
+      if (e->hash == hash && same_strokes(e->strokes, s)) {
+	free_strokes(s);
+	interned_shared++;
+	return e->strokes;
       }
-      *delim_found = *d;
-      if (*src) {
-	*src = '\0';
-	token_src = src+1;
-      } else {
-	token_src = NULL;
-      }
-      return token_start;
     }
-    src++;
   }
-  token_src = NULL;
-  *delim_found = '\0';
-  if (src == token_start) {
-    return NULL;
+  if (interned_count >= interned_size) {
+    grow_interned();
   }
-  return token_start;
+  e = (interned_strokes *)allocate(sizeof(interned_strokes));
+  e->hash = hash;
+  e->used = 0;
+  e->strokes = s;
+  e->next = interned[hash % interned_size];
+  interned[hash % interned_size] = e;
+  interned_count++;
+  return s;
 }
 
-typedef struct _keysymmapping {
-  char *str;
-  KeySym sym;
-} keysymmapping;
-
-static keysymmapping key_sym_mapping[] = {
-#include "keys.h"
-  { "XK_Button_1", XK_Button_1 },
-  { "XK_Button_2", XK_Button_2 },
-  { "XK_Button_3", XK_Button_3 },
-  { "XK_Scroll_Up", XK_Scroll_Up },
-  { "XK_Scroll_Down", XK_Scroll_Down },
-  { NULL, 0 }
-};
-
-KeySym
-string_to_KeySym(char *str)
+void
+mark_interned_strokes(stroke *s)
 {
-  size_t len = strlen(str) + 1;
-  int i = 0;
+  interned_strokes *e;
 
-  while (key_sym_mapping[i].str != NULL) {
-    if (!strncmp(str, key_sym_mapping[i].str, len)) {
-      return key_sym_mapping[i].sym;
+  if (s == NULL) {
+    return;
+  }
+  for (e = interned[hash_strokes(s) % interned_size]; e != NULL; e = e->next) {
+    if (e->strokes == s) {
+      e->used = 1;
+      return;
     }
-    i++;
   }
-  return 0;
 }
 
-char *
-KeySym_to_string(KeySym ks)
+// free the sequences which aren't bound in any linked section
+void
+sweep_interned_strokes(void)
 {
-  int i = 0;
+  translation *tr;
+  chord *c;
+  interned_strokes **ep;
+  interned_strokes *e;
+  unsigned int i;
 
-  while (key_sym_mapping[i].sym != 0) {
-    if (key_sym_mapping[i].sym == ks) {
-      return key_sym_mapping[i].str;
+  if (interned_size == 0) {
+    return;
+  }
+  for (tr = first_translation_section; tr != NULL; tr = tr->next) {
+    for (i=0; i<NUM_KEYS; i++) {
+      mark_interned_strokes(tr->key_down[i]);
+      mark_interned_strokes(tr->key_up[i]);
+      mark_interned_strokes(tr->hold_down[i]);
+      mark_interned_strokes(tr->hold_up[i]);
+      mark_interned_strokes(tr->double_down[i]);
+      mark_interned_strokes(tr->double_up[i]);
+    }
+    for (i=0; i<NUM_SHUTTLES; i++) {
+      mark_interned_strokes(tr->shuttle[i]);
+    }
+    for (i=0; i<NUM_JOGS; i++) {
+      mark_interned_strokes(tr->jog[i]);
+    }
+    for (c = tr->chords; c != NULL; c = c->next) {
+      mark_interned_strokes(c->down);
+      mark_interned_strokes(c->up);
+    }
+  }
+  for (i=0; i<interned_size; i++) {
+    ep = &interned[i];
+    while ((e = *ep) != NULL) {
+      if (e->used) {
+	e->used = 0;
+	ep = &e->next;
+      } else {
+	*ep = e->next;
+	free_strokes(e->strokes);
+	free(e);
+	interned_count--;
+      }
     }
-    i++;
   }
-  return NULL;
 }
 
+static int compiled_regex_count = 0;
+
 void
-print_stroke(stroke *s)
+free_translation_section(translation *tr)
 {
-  char *str;
+  chord *c;
 
-  if (s != NULL) {
-    str = KeySym_to_string(s->keysym);
-    if (str == NULL) {
-      printf("0x%x", (int)s->keysym);
-      str = "???";
+  if (tr != NULL) {
+    free(tr->name);
+    free(tr->pattern);
+    if (tr->literal != NULL) {
+      free(tr->literal);
+    } else if (tr->regex_state == REGEX_COMPILED) {
+      regfree(&tr->regex);
+      stat_set(STAT_COMPILED_REGEX, --compiled_regex_count);
     }
-    printf("%s/%c ", str, s->press ? 'D' : 'U');
+    // the stroke sequences belong to the interning table
+    while (tr->chords != NULL) {
+      c = tr->chords;
+      tr->chords = c->next;
+      free(c);
+    }
+    free(tr);
   }
 }
 
-void
-print_stroke_sequence(char *name, char *up_or_down, stroke *s)
+// add an empty chord binding for the two keys.  returns NULL if they
+// already have one.
+chord *
+add_chord(translation *tr, int key1, int key2)
 {
-  printf("%s[%s]: ", name, up_or_down);
-  while (s) {
-    print_stroke(s);
-    s = s->next;
+  chord **cp;
+  chord *c;
+  int t;
+
+  if (key1 > key2) {
+    t = key1;
+    key1 = key2;
+    key2 = t;
   }
-  printf("\n");
+  for (cp = &tr->chords; *cp != NULL; cp = &(*cp)->next) {
+    if ((*cp)->key1 == key1 && (*cp)->key2 == key2) {
+      return NULL;
+    }
+  }
+  c = (chord *)allocate(sizeof(chord));
+  c->next = NULL;
+  c->key1 = key1;
+  c->key2 = key2;
+  c->down = NULL;
+  c->up = NULL;
+  *cp = c;
+  tr->gesture_keys |= (1 << key1) | (1 << key2);
+  return c;
 }
 
-stroke **first_stroke;
-stroke *last_stroke;
-stroke **press_first_stroke;
-stroke **release_first_stroke;
-int is_keystroke;
-char *current_translation;
-char *key_name;
-int first_release_stroke; // is this the first stroke of a release?
-KeySym regular_key_down;
-
-#define NUM_MODIFIERS 64
+// called before the translations are freed for a reload, so that
+// nothing is left pointing at them
+void (*config_reload_hook)(void) = NULL;
 
-stroke modifiers_down[NUM_MODIFIERS];
-int modifier_count;
+static unsigned long regex_clock = 0;
 
+// free the compiled regex which was used least recently
 void
-append_stroke(KeySym sym, int press)
+evict_compiled_regex(void)
 {
-  stroke *s = (stroke *)allocate(sizeof(stroke));
+  translation *tr;
+  translation *victim = NULL;
 
-  s->next = NULL;
-  s->keysym = sym;
-  s->press = press;
-  if (*first_stroke) {
-    last_stroke->next = s;
-  } else {
-    *first_stroke = s;
+  for (tr = first_translation_section; tr != NULL; tr = tr->next) {
+    if (tr->regex_state == REGEX_COMPILED &&
+	(victim == NULL || tr->regex_last_used < victim->regex_last_used)) {
+      victim = tr;
+    }
+  }
+  if (victim != NULL) {
+    regfree(&victim->regex);
+    victim->regex_state = REGEX_UNCOMPILED;
+    stat_set(STAT_COMPILED_REGEX, --compiled_regex_count);
   }
-  last_stroke = s;
 }
 
-// s->press values in modifiers_down:
-// PRESS -> down
-// HOLD -> held
-// PRESS_RELEASE -> released, but to be re-pressed if necessary
-// RELEASE -> up
-
-void
-mark_as_down(KeySym sym, int hold)
+// compile the section's regex if that hasn't been done yet.  returns 0
+// if the regex is bad.
+int
+compile_regex(translation *tr)
 {
-  int i;
+  char errbuf[256];
+  int err;
 
-  for (i=0; i<modifier_count; i++) {
-    if (modifiers_down[i].keysym == sym) {
-      modifiers_down[i].press = hold ? HOLD : PRESS;
-      return;
+  if (tr->regex_state == REGEX_UNCOMPILED) {
+    while (settings.max_compiled_regex > 0 &&
+	   compiled_regex_count >= settings.max_compiled_regex) {
+      evict_compiled_regex();
+    }
+    err = regcomp(&tr->regex, tr->pattern, REG_NOSUB);
+    if (err != 0) {
+      regerror(err, &tr->regex, errbuf, sizeof(errbuf));
+      fprintf(stderr, "error compiling regex for [%s]: %s\n", tr->name, errbuf);
+      regfree(&tr->regex);
+      tr->regex_state = REGEX_BAD;
+    } else {
+      tr->regex_state = REGEX_COMPILED;
+      stat_set(STAT_COMPILED_REGEX, ++compiled_regex_count);
     }
   }
-  if (modifier_count > NUM_MODIFIERS) {
-    fprintf(stderr, "too many modifiers down in [%s]%s\n", current_translation, key_name);
-    return;
-  }
-  modifiers_down[modifier_count].keysym = sym;
-  modifiers_down[modifier_count].press = hold ? HOLD : PRESS;
-  modifier_count++;
+  tr->regex_last_used = ++regex_clock;
+  return tr->regex_state == REGEX_COMPILED;
 }
 
+// small LRU cache of recently seen window titles and the translation
+// they selected, so that focus bouncing between a few windows doesn't
+// rescan every section.  Cleared whenever the config file is reloaded.
+#define TITLE_CACHE_SIZE 16
+
+typedef struct _title_cache_entry {
+  char *title; // NULL if the entry is unused
+  unsigned int hash;
+  unsigned long last_used;
+  translation *tr;
+} title_cache_entry;
+
+static title_cache_entry title_cache[TITLE_CACHE_SIZE];
+static unsigned long title_cache_clock = 0;
+
 void
-mark_as_up(KeySym sym)
+clear_title_cache(void)
 {
   int i;
 
-  for (i=0; i<modifier_count; i++) {
-    if (modifiers_down[i].keysym == sym) {
-      modifiers_down[i].press = RELEASE;
-      return;
+  for (i=0; i<TITLE_CACHE_SIZE; i++) {
+    if (title_cache[i].title != NULL) {
+      free(title_cache[i].title);
+      title_cache[i].title = NULL;
     }
   }
 }
 
-void
-release_modifiers(int allkeys)
+// returns the cache entry for the title, or NULL on a miss
+title_cache_entry *
+lookup_title_cache(char *win_title, unsigned int hash)
 {
   int i;
 
-  for (i=0; i<modifier_count; i++) {
-    if (modifiers_down[i].press == PRESS) {
+  for (i=0; i<TITLE_CACHE_SIZE; i++) {
+    if (title_cache[i].title != NULL && title_cache[i].hash == hash &&
+	!strcmp(title_cache[i].title, win_title)) {
+      title_cache[i].last_used = ++title_cache_clock;
+      stat_add(STAT_TITLE_CACHE_HITS, 1);
+      return &title_cache[i];
+    }
+  }
+  stat_add(STAT_TITLE_CACHE_MISSES, 1);
+  return NULL;
+}
+
+void
+add_title_cache(char *win_title, unsigned int hash, translation *tr)
+{
+  title_cache_entry *victim = &title_cache[0];
+  int i;
+
+  for (i=0; i<TITLE_CACHE_SIZE; i++) {
+    if (title_cache[i].title == NULL) {
+      victim = &title_cache[i];
+      break;
+    }
+    if (title_cache[i].last_used < victim->last_used) {
+      victim = &title_cache[i];
+    }
+  }
+  if (victim->title != NULL) {
+    free(victim->title);
+  }
+  victim->title = alloc_strcat(win_title, NULL);
+  victim->hash = hash;
+  victim->last_used = ++title_cache_clock;
+  victim->tr = tr;
+}
+
+static char *config_file_name = NULL;
+
+// The config file is mapped (or, if that fails, read) into memory in
+// one go and parsed in a single forward pass.  Tokens are views into
+// that memory, which is never written to, so nothing but the compiled
+// tables gets allocated.  All of the tokenizer state is in the
+// config_parser, which also knows where we are for error messages.
+
+typedef struct _config_parser {
+  char *file_name;
+  char *buf;
+  size_t len;
+  int mapped;
+  char *line; // start of the current line
+  char *line_end; // the \n at the end of it, or the end of the buffer
+  char *pos; // where the next token search starts
+  int line_num;
+  fragment *frag;
+  int errors; // reported by parse_error()
+} config_parser;
+
+typedef struct _config_token {
+  char *str;
+  int len;
+  char delim; // '"' for a quoted string, else what ended the token
+} config_token;
+
+// returns 0 after printing an error if the file can't be read.
+// st is filled in from the open file.
+int
+open_config_parser(config_parser *p, char *file_name, struct stat *st)
+{
+  int fd;
+  ssize_t n;
+  size_t pos = 0;
+
+  memset(p, 0, sizeof(*p));
+  p->file_name = file_name;
+  fd = open(file_name, O_RDONLY);
+  if (fd < 0 || fstat(fd, st) < 0) {
+    perror(file_name);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 0;
+  }
+  p->len = st->st_size;
+  if (p->len > 0) {
+    p->buf = mmap(NULL, p->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p->buf != MAP_FAILED) {
+      p->mapped = 1;
+    } else {
+      p->buf = allocate(p->len);
+      while (pos < p->len) {
+	n = read(fd, p->buf + pos, p->len - pos);
+	if (n <= 0) {
+	  break;
+	}
+	pos += n;
+      }
+      if (pos < p->len) {
+	perror(file_name);
+	free(p->buf);
+	close(fd);
+	return 0;
+      }
+    }
+  }
+  close(fd);
+  return 1;
+}
+
+void
+close_config_parser(config_parser *p)
+{
+  if (p->mapped) {
+    munmap(p->buf, p->len);
+  } else {
+    free(p->buf);
+  }
+  p->buf = NULL;
+}
+
+// advance to the next line.  returns 0 at the end of the file.
+int
+next_line(config_parser *p)
+{
+  char *end = p->buf + p->len;
+
+  if (p->len == 0) {
+    return 0;
+  }
+  p->line = p->line_end == NULL ? p->buf : p->line_end + 1;
+  if (p->line >= end) {
+    return 0;
+  }
+  p->line_end = memchr(p->line, '\n', end - p->line);
+  if (p->line_end == NULL) {
+    p->line_end = end; // partial line at EOF
+  }
+  p->pos = p->line;
+  p->line_num++;
+  return 1;
+}
+
+// similar to strtok, but it tells us what delimiter was found at the
+// end of the token, handles double quoted strings specially, and
+// hardcodes the delimiter set.  The delimiter is consumed along with
+// the token.  returns 0 when there are no more tokens on the line.
+int
+next_token(config_parser *p, config_token *t)
+{
+  char *s = p->pos;
+  char *end = p->line_end;
+
+  while (s < end && (*s == ' ' || *s == '\t' || *s == '/')) {
+    s++;
+  }
+  if (s >= end) {
+    p->pos = end;
+    return 0;
+  }
+  if (*s == '"') {
+    t->str = ++s;
+    while (s < end && *s != '"') {
+      s++;
+    }
+    t->delim = '"';
+  } else {
+    t->str = s;
+    while (s < end && *s != ' ' && *s != '\t' && *s != '/' && *s != '"') {
+      s++;
+    }
+    t->delim = s < end ? *s : '\n';
+  }
+  t->len = s - t->str;
+  p->pos = s < end ? s+1 : end;
+  return 1;
+}
+
+int
+token_is(config_token *t, char *word)
+{
+  return t->len == (int)strlen(word) && !memcmp(t->str, word, t->len);
+}
+
+// parse an optionally signed decimal number at the start of the len
+// bytes at s.  returns how many bytes were used, 0 if there's no number.
+int
+parse_number(char *s, int len, int *value)
+{
+  int i = 0;
+  int negative = 0;
+  int v = 0;
+
+  if (i < len && (s[i] == '-' || s[i] == '+')) {
+    negative = s[i] == '-';
+    i++;
+  }
+  if (i >= len || !isdigit((unsigned char)s[i])) {
+    return 0;
+  }
+  while (i < len && isdigit((unsigned char)s[i])) {
+    if (v <= (INT_MAX - 9) / 10) {
+      v = v * 10 + (s[i] - '0');
+    }
+    i++;
+  }
+  *value = negative ? -v : v;
+  return i;
+}
+
+// print an error message prefixed with file:line:column of at, which
+// points into the current line
+void
+parse_error(config_parser *p, char *at, char *format, ...)
+{
+  char message[512];
+  va_list ap;
+
+  va_start(ap, format);
+  vsnprintf(message, sizeof(message), format, ap);
+  va_end(ap);
+  p->errors++;
+  // parse threads can get here at the same time
+  atomic_fetch_add_explicit(&stats[STAT_PARSE_ERRORS], 1, memory_order_relaxed);
+  // one write, so messages from parallel parses don't get mixed up
+  fprintf(stderr, "%s:%d:%d: %s\n", p->file_name, p->line_num,
+	  (int)(at - p->line) + 1, message);
+}
+
+typedef struct _keysymmapping {
+  char *str;
+  KeySym sym;
+} keysymmapping;
+
+static keysymmapping key_sym_mapping[] = {
+#include "keys.h"
+  { "XK_Button_1", XK_Button_1 },
+  { "XK_Button_2", XK_Button_2 },
+  { "XK_Button_3", XK_Button_3 },
+  { "XK_Scroll_Up", XK_Scroll_Up },
+  { "XK_Scroll_Down", XK_Scroll_Down },
+  { NULL, 0 }
+};
+
+// open addressed hash table of indexes into key_sym_mapping, built
+// before the first parse.  Power of two, at least twice the size of
+// the mapping.
+static int *keysym_hash = NULL;
+static unsigned int keysym_hash_size = 0;
+
+void
+init_keysym_hash(void)
+{
+  unsigned int count = 0;
+  unsigned int h;
+  unsigned int i;
+
+  if (keysym_hash != NULL) {
+    return;
+  }
+  while (key_sym_mapping[count].str != NULL) {
+    count++;
+  }
+  keysym_hash_size = 64;
+  while (keysym_hash_size < count * 2) {
+    keysym_hash_size *= 2;
+  }
+  keysym_hash = (int *)allocate(keysym_hash_size * sizeof(int));
+  for (h=0; h<keysym_hash_size; h++) {
+    keysym_hash[h] = -1;
+  }
+  for (i=0; i<count; i++) {
+    h = hash_string(key_sym_mapping[i].str) & (keysym_hash_size - 1);
+    while (keysym_hash[h] >= 0) {
+      if (!strcmp(key_sym_mapping[keysym_hash[h]].str, key_sym_mapping[i].str)) {
+	break; // the first entry for a name wins
+      }
+      h = (h + 1) & (keysym_hash_size - 1);
+    }
+    if (keysym_hash[h] < 0) {
+      keysym_hash[h] = i;
+    }
+  }
+}
+
+KeySym
+string_to_KeySym(char *str, int len)
+{
+  unsigned int h = hash_bytes(str, len, HASH_SEED) & (keysym_hash_size - 1);
+  keysymmapping *m;
+
+  while (keysym_hash[h] >= 0) {
+    m = &key_sym_mapping[keysym_hash[h]];
+    if (!strncmp(str, m->str, len) && m->str[len] == '\0') {
+      return m->sym;
+    }
+    h = (h + 1) & (keysym_hash_size - 1);
+  }
+  return 0;
+}
+
+char *
+KeySym_to_string(KeySym ks)
+{
+  int i = 0;
+
+  while (key_sym_mapping[i].sym != 0) {
+    if (key_sym_mapping[i].sym == ks) {
+      return key_sym_mapping[i].str;
+    }
+    i++;
+  }
+  return NULL;
+}
+
+void
+print_stroke(stroke *s)
+{
+  char *str;
+
+  if (s != NULL) {
+    str = KeySym_to_string(s->keysym);
+    if (str == NULL) {
+      printf("0x%x", (int)s->keysym);
+      str = "???";
+    }
+    if (s->delay > 0) {
+      printf("+%dms ", s->delay);
+    }
+    printf("%s/%c ", str, s->press ? 'D' : 'U');
+  }
+}
+
+void
+print_stroke_sequence(config_token *name, char *up_or_down, stroke *s)
+{
+  printf("%.*s[%s]: ", name->len, name->str, up_or_down);
+  while (s) {
+    print_stroke(s);
+    s = s->next;
+  }
+  printf("\n");
+}
+
+// the state of the binding being compiled.  Files are parsed on
+// several threads at once, so each has its own.
+static __thread stroke **first_stroke;
+static __thread stroke *last_stroke;
+static __thread stroke **press_first_stroke;
+static __thread stroke **release_first_stroke;
+static __thread int is_keystroke;
+static __thread char *current_translation;
+static __thread config_token key_name;
+static __thread int first_release_stroke; // is this the first stroke of a release?
+static __thread KeySym regular_key_down;
+static __thread int pending_delay; // delay for the next stroke appended
+static __thread config_token pending_delay_word; // the delay= it came from
+static __thread int *current_scroll_rate; // NULL unless binding a shuttle position
+
+#define NUM_MODIFIERS 64
+
+static __thread stroke modifiers_down[NUM_MODIFIERS];
+static __thread int modifier_count;
+
+void
+append_stroke(KeySym sym, int press)
+{
+  stroke *s = (stroke *)allocate(sizeof(stroke));
+
+  s->next = NULL;
+  s->keysym = sym;
+  s->press = press;
+  s->delay = pending_delay;
+  pending_delay = 0;
+  if (*first_stroke) {
+    last_stroke->next = s;
+  } else {
+    *first_stroke = s;
+  }
+  last_stroke = s;
+}
+
+// s->press values in modifiers_down:
+// PRESS -> down
+// HOLD -> held
+// PRESS_RELEASE -> released, but to be re-pressed if necessary
+// RELEASE -> up
+
+void
+mark_as_down(KeySym sym, int hold)
+{
+  int i;
+
+  for (i=0; i<modifier_count; i++) {
+    if (modifiers_down[i].keysym == sym) {
+      modifiers_down[i].press = hold ? HOLD : PRESS;
+      return;
+    }
+  }
+  if (modifier_count > NUM_MODIFIERS) {
+    fprintf(stderr, "too many modifiers down in [%s]%.*s\n", current_translation,
+	    key_name.len, key_name.str);
+    return;
+  }
+  modifiers_down[modifier_count].keysym = sym;
+  modifiers_down[modifier_count].press = hold ? HOLD : PRESS;
+  modifier_count++;
+}
+
+void
+mark_as_up(KeySym sym)
+{
+  int i;
+
+  for (i=0; i<modifier_count; i++) {
+    if (modifiers_down[i].keysym == sym) {
+      modifiers_down[i].press = RELEASE;
+      return;
+    }
+  }
+}
+
+void
+release_modifiers(int allkeys)
+{
+  int i;
+
+  for (i=0; i<modifier_count; i++) {
+    if (modifiers_down[i].press == PRESS) {
       append_stroke(modifiers_down[i].keysym, 0);
       modifiers_down[i].press = PRESS_RELEASE;
     } else if (allkeys && modifiers_down[i].press == HOLD) {
@@ -485,66 +1297,108 @@ re_press_temp_modifiers(void)
 }
 
 int
-start_translation(translation *tr, char *which_key)
+start_translation(config_parser *p, translation *tr, config_token *which_key)
 {
+  char *name = which_key->str;
+  int len = which_key->len;
   char c;
   int k;
+  int k2;
   int n;
+  char *gesture;
+  int gesture_len;
+  chord *ch;
 
-  //printf("start_translation(%s)\n", which_key);
+  //printf("start_translation(%.*s)\n", len, name);
 
   if (tr == NULL) {
-    fprintf(stderr, "need to start translation section before defining key: %s\n", which_key);
+    parse_error(p, name, "need to start translation section before defining key: %.*s", len, name);
     return 1;
   }
   current_translation = tr->name;
-  key_name = which_key;
+  key_name = *which_key;
   is_keystroke = 0;
   first_release_stroke = 0;
   regular_key_down = 0;
   modifier_count = 0;
+  pending_delay = 0;
+  current_scroll_rate = NULL;
   // JL, JR
-  if (tolower(which_key[0]) == 'j' &&
-      (tolower(which_key[1]) == 'l' || tolower(which_key[1]) == 'r') &&
-      which_key[2] == '\0') {
-    k = tolower(which_key[1]) == 'l' ? 0 : 1;
+  if (len == 2 && tolower(name[0]) == 'j' &&
+      (tolower(name[1]) == 'l' || tolower(name[1]) == 'r')) {
+    k = tolower(name[1]) == 'l' ? 0 : 1;
     first_stroke = &(tr->jog[k]);
   } else {
-    n = 0;
-    sscanf(which_key, "%c%d%n", &c, &k, &n);
-    if (n != (int)strlen(which_key)) {
-      fprintf(stderr, "bad key name: [%s]%s\n", current_translation, which_key);
+    c = name[0];
+    n = parse_number(name+1, len-1, &k);
+    gesture = name + 1 + n;
+    gesture_len = len - 1 - n;
+    if (n == 0 || (gesture_len != 0 && tolower(c) != 'k')) {
+      parse_error(p, name, "bad key name: %.*s", len, name);
       return 1;
     }
     switch (c) {
     case 'k':
     case 'K':
-      // K1 .. K15
+      // K1 .. K15, optionally K<n>:hold, K<n>:double or K<n>+K<m>
       k = k - 1;
       if (k < 0 || k >= NUM_KEYS) {
-	fprintf(stderr, "bad key name: [%s]%s\n", current_translation, which_key);
+	parse_error(p, name, "bad key name: %.*s", len, name);
 	return 1;
       }
-      first_stroke = &(tr->key_down[k]);
-      release_first_stroke = &(tr->key_up[k]);
+      if (gesture_len == 0) {
+	first_stroke = &(tr->key_down[k]);
+	release_first_stroke = &(tr->key_up[k]);
+      } else if (gesture_len == 5 && !memcmp(gesture, ":hold", 5)) {
+	first_stroke = &(tr->hold_down[k]);
+	release_first_stroke = &(tr->hold_up[k]);
+	tr->gesture_keys |= 1 << k;
+      } else if (gesture_len == 7 && !memcmp(gesture, ":double", 7)) {
+	first_stroke = &(tr->double_down[k]);
+	release_first_stroke = &(tr->double_up[k]);
+	tr->gesture_keys |= 1 << k;
+      } else {
+	n = 0;
+	k2 = 0;
+	if (gesture_len > 2 && gesture[0] == '+' && tolower(gesture[1]) == 'k') {
+	  n = parse_number(gesture+2, gesture_len-2, &k2);
+	}
+	k2 = k2 - 1;
+	if (n == 0 || n != gesture_len-2 || k2 < 0 || k2 >= NUM_KEYS || k2 == k) {
+	  parse_error(p, name, "bad key name: %.*s", len, name);
+	  return 1;
+	}
+	ch = add_chord(tr, k, k2);
+	if (ch == NULL) {
+	  parse_error(p, name, "can't redefine key: %.*s", len, name);
+	  return 1;
+	}
+	first_stroke = &(ch->down);
+	release_first_stroke = &(ch->up);
+      }
       is_keystroke = 1;
       break;
     case 's':
     case 'S':
       // S-7 .. S7
       if (k < -7 || k > 7) {
-	fprintf(stderr, "bad key name: [%s]%s\n", current_translation, which_key);
+	parse_error(p, name, "bad key name: %.*s", len, name);
 	return 1;
       }
       first_stroke = &(tr->shuttle[k+7]);
+      if (tr->scroll_rate[k+7] != 0) {
+	parse_error(p, name, "can't redefine key: %.*s", len, name);
+	return 1;
+      }
+      current_scroll_rate = &(tr->scroll_rate[k+7]);
       break;
     default:
-      fprintf(stderr, "bad key name: [%s]%s\n", current_translation, which_key);
+      parse_error(p, name, "bad key name: %.*s", len, name);
       return 1;
     }
   }
   if (*first_stroke != NULL) {
-    fprintf(stderr, "can't redefine key: [%s]%s\n", current_translation, which_key);
+    parse_error(p, name, "can't redefine key: %.*s", len, name);
     return 1;
   }
   press_first_stroke = first_stroke;
@@ -598,27 +1452,77 @@ add_release(int all_keys)
   first_release_stroke = 1;
 }
 
+// delay=<n>ms or delay=<n>
+int
+add_delay(config_parser *p, config_token *word)
+{
+  char *num = word->str + 6;
+  int len = word->len - 6;
+  int ms;
+  int n;
+
+  if (word->len < 6 || memcmp(word->str, "delay=", 6)) {
+    return 0;
+  }
+  n = parse_number(num, len, &ms);
+  if (n == 0 || ms < 0 ||
+      (n != len && (len - n != 2 || memcmp(num+n, "ms", 2)))) {
+    parse_error(p, word->str, "bad delay: %.*s", word->len, word->str);
+  } else {
+    pending_delay += ms;
+    pending_delay_word = *word;
+  }
+  return 1;
+}
+
+// scroll=<n>
+int
+add_scroll(config_parser *p, config_token *word)
+{
+  int rate;
+  int n;
+
+  if (word->len < 7 || memcmp(word->str, "scroll=", 7)) {
+    return 0;
+  }
+  if (current_scroll_rate == NULL) {
+    parse_error(p, word->str, "scroll= only works for shuttle positions");
+    return 1;
+  }
+  n = parse_number(word->str+7, word->len-7, &rate);
+  if (n == 0 || n != word->len-7) {
+    parse_error(p, word->str, "bad scroll rate: %.*s", word->len, word->str);
+  } else {
+    *current_scroll_rate = rate;
+  }
+  return 1;
+}
+
 void
-add_keystroke(char *keySymName, int press_release)
+add_keystroke(config_parser *p, config_token *keySymName, int press_release)
 {
   KeySym sym;
 
-  if (is_keystroke && !strncmp(keySymName, "RELEASE", 8)) {
+  if (is_keystroke && token_is(keySymName, "RELEASE")) {
     add_release(0);
     return;
   }
-  sym = string_to_KeySym(keySymName);
+  if (add_delay(p, keySymName) || add_scroll(p, keySymName)) {
+    return;
+  }
+  sym = string_to_KeySym(keySymName->str, keySymName->len);
   if (sym != 0) {
     add_keysym(sym, press_release);
   } else {
-    fprintf(stderr, "unrecognized KeySym: %s\n", keySymName);
+    parse_error(p, keySymName->str, "unrecognized KeySym: %.*s",
+		keySymName->len, keySymName->str);
   }
 }
 
 void
-add_string(char *str)
+add_string(char *str, int len)
 {
-  while (str && *str) {
+  while (len-- > 0) {
     if (*str >= ' ' && *str <= '~') {
       add_keysym((KeySym)(*str), PRESS_RELEASE);
     }
@@ -626,184 +1530,1066 @@ add_string(char *str)
   }
 }
 
+// a MACRO definition: the name, and the output tokens to use wherever
+// @name appears in a binding.  The tokens are views into the config
+// file, so macros only last as long as the parse.
+typedef struct _macro_token {
+  struct _macro_token *next;
+  config_token tok;
+  config_token updown; // str is NULL unless tok.delim is '/'
+} macro_token;
+
+typedef struct _macro {
+  struct _macro *next;
+  config_token name;
+  macro_token *tokens;
+} macro;
+
+static __thread macro *macros = NULL;
+
 void
-finish_translation(void)
+free_macros(void)
 {
-  //printf("finish_translation()\n");
+  macro *m;
+  macro_token *t;
+
+  while (macros != NULL) {
+    m = macros;
+    macros = m->next;
+    while (m->tokens != NULL) {
+      t = m->tokens;
+      m->tokens = t->next;
+      free(t);
+    }
+    free(m);
+  }
+}
+
+macro *
+find_macro(char *name, int len)
+{
+  macro *m;
+
+  for (m = macros; m != NULL; m = m->next) {
+    if (m->name.len == len && !memcmp(m->name.str, name, len)) {
+      return m;
+    }
+  }
+  return NULL;
+}
+
+// handle one token of an output sequence.  If it ended with '/',
+// updown is the modifier after it.
+void
+add_output(config_parser *p, config_token *tok, config_token *updown)
+{
+  macro *m;
+  macro_token *t;
+
+  switch (tok->delim) {
+  case '"':
+    add_string(tok->str, tok->len);
+    break;
+  case '/':
+    switch (updown->len == 1 ? updown->str[0] : '\0') {
+    case 'U':
+      add_keystroke(p, tok, RELEASE);
+      break;
+    case 'D':
+      add_keystroke(p, tok, PRESS);
+      break;
+    case 'H':
+      add_keystroke(p, tok, HOLD);
+      break;
+    default:
+      parse_error(p, updown->str, "invalid up/down modifier: %.*s", updown->len, updown->str);
+      add_keystroke(p, tok, PRESS);
+      break;
+    }
+    break;
+  default:
+    if (tok->len > 0 && tok->str[0] == '@') {
+      m = find_macro(tok->str+1, tok->len-1);
+      if (m == NULL) {
+	parse_error(p, tok->str, "undefined macro: %.*s", tok->len, tok->str);
+      } else {
+	for (t = m->tokens; t != NULL; t = t->next) {
+	  add_output(p, &t->tok, &t->updown);
+	}
+      }
+    } else {
+      add_keystroke(p, tok, PRESS_RELEASE);
+    }
+    break;
+  }
+}
+
+// read the rest of the line as output tokens, calling add_output() on
+// each, or adding them to m if it's not NULL
+void
+parse_output(config_parser *p, macro *m)
+{
+  config_token tok;
+  config_token updown;
+  macro_token **tail = m != NULL ? &m->tokens : NULL;
+  macro_token *t;
+  char *at;
+
+  while (next_token(p, &tok)) {
+    if (tok.delim != '"' && tok.len > 0 && tok.str[0] == '#') {
+      break; // skip rest as comment
+    }
+    //printf("token: [%.*s] delim [%d]\n", tok.len, tok.str, tok.delim);
+    updown.str = NULL;
+    updown.len = 0;
+    if (tok.delim == '/' && !next_token(p, &updown)) {
+      break;
+    }
+    if (m == NULL) {
+      add_output(p, &tok, &updown);
+      continue;
+    }
+    if (tok.delim != '"' && tok.delim != '/' && tok.len > 0 && tok.str[0] == '@' &&
+	find_macro(tok.str+1, tok.len-1) == NULL) {
+      parse_error(p, tok.str, "undefined macro in MACRO %.*s: %.*s",
+		  m->name.len, m->name.str, tok.len, tok.str);
+      continue;
+    }
+    t = (macro_token *)allocate(sizeof(macro_token));
+    t->next = NULL;
+    t->tok = tok;
+    t->updown = updown;
+    *tail = t;
+    tail = &t->next;
+  }
+  // a delay is a wait before the next stroke, so one at the end would
+  // only hold up the releases
+  if (m == NULL && pending_delay != 0) {
+    // from a macro, the word is on another line
+    at = pending_delay_word.str;
+    if (at < p->line || at >= p->line_end) {
+      at = p->line_end;
+    }
+    parse_error(p, at, "nothing after %.*s to wait for",
+		pending_delay_word.len, pending_delay_word.str);
+    pending_delay = 0;
+  }
+}
+
+// MACRO name output...
+//
+// The output tokens are checked and stored, to be replayed wherever
+// @name is used.  Macros can use other macros defined before them.
+void
+define_macro(config_parser *p, config_token *keyword)
+{
+  config_token name;
+  macro *m;
+
+  if (!next_token(p, &name) || name.delim == '"' || name.delim == '/') {
+    parse_error(p, keyword->str, "MACRO needs a name");
+    return;
+  }
+  if (find_macro(name.str, name.len) != NULL) {
+    parse_error(p, name.str, "can't redefine macro: %.*s", name.len, name.str);
+    return;
+  }
+  m = (macro *)allocate(sizeof(macro));
+  m->name = name;
+  m->tokens = NULL;
+  parse_output(p, m);
+  m->next = macros;
+  macros = m;
+}
+
+void
+finish_translation(void)
+{
+  //printf("finish_translation()\n");
   if (is_keystroke) {
     add_release(0);
   }
   add_release(1);
   if (debug_strokes) {
     if (is_keystroke) {
-      print_stroke_sequence(key_name, "D", *press_first_stroke);
-      print_stroke_sequence(key_name, "U", *release_first_stroke);
+      print_stroke_sequence(&key_name, "D", *press_first_stroke);
+      print_stroke_sequence(&key_name, "U", *release_first_stroke);
     } else {
-      print_stroke_sequence(key_name, "", *first_stroke);
+      print_stroke_sequence(&key_name, "", *first_stroke);
+      if (current_scroll_rate != NULL && *current_scroll_rate != 0) {
+	printf("%.*s: scroll %d/s\n", key_name.len, key_name.str, *current_scroll_rate);
+      }
     }
     printf("\n");
   }
 }
 
+// one [name] regex line
+translation *
+parse_section_header(config_parser *p, char *s)
+{
+  char *name = ++s;
+  char *regex = NULL;
+  char *end = p->line_end;
+  size_t regex_len = 0;
+
+  while (s < end && *s != ']') {
+    s++;
+  }
+  if (s < end) {
+    regex = s+1;
+    while (regex < end && isspace((unsigned char)*regex)) {
+      regex++;
+    }
+    while (end > regex && isspace((unsigned char)end[-1])) {
+      end--;
+    }
+    regex_len = end - regex;
+  }
+  return new_translation_section(name, s - name, regex, regex_len);
+}
+
+// the directives which change settings.  These apply to the whole
+// config, so they are only allowed in the main file.
+static char *setting_names[] = {
+  "DEBUG_REGEX", "DEBUG_STROKES", "DEBUG_GESTURES", "HOLD_TIME",
+  "DOUBLE_TIME", "CHORD_TIME", "XTEST_DELAYS", "MAX_COMPILED_REGEX",
+  "NO_COALESCE", "EVENT_DEADLINE", "DEBUG_EVENTS", "JOG_TIMED",
+  "TRACE_THRESHOLD", "JOG_MAX_STEPS", NULL
+};
+
+int
+is_setting(config_token *tok)
+{
+  int i;
+
+  for (i=0; setting_names[i] != NULL; i++) {
+    if (token_is(tok, setting_names[i])) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// include file_name
+// include_dir directory
+//
+// The name is the rest of the line, relative to the directory of the
+// file it's in unless it starts with a /.
 void
-read_config_file(void)
+parse_include(config_parser *p, config_token *keyword)
+{
+  char *start = p->pos;
+  char *end = p->line_end;
+  char *dir_end;
+  char *include;
+  size_t dir_len = 0;
+
+  while (start < end && isspace((unsigned char)*start)) {
+    start++;
+  }
+  while (end > start && isspace((unsigned char)end[-1])) {
+    end--;
+  }
+  if (start == end) {
+    parse_error(p, keyword->str, "%.*s needs a file name", keyword->len, keyword->str);
+    return;
+  }
+  dir_end = strrchr(p->file_name, '/');
+  if (*start != '/' && dir_end != NULL) {
+    dir_len = dir_end - p->file_name + 1;
+  }
+  include = allocate(dir_len + (end - start) + 1);
+  memcpy(include, p->file_name, dir_len);
+  memcpy(include + dir_len, start, end - start);
+  include[dir_len + (end - start)] = '\0';
+  add_fragment_item(p->frag, NULL, include, keyword->len > 7);
+}
+
+// HOLD_TIME, DOUBLE_TIME, CHORD_TIME and MAX_COMPILED_REGEX all take a
+// number, which must be positive for the times
+void
+parse_setting(config_parser *p, config_token *keyword, int *setting, int minimum)
+{
+  config_token tok;
+
+  if (!next_token(p, &tok) || parse_number(tok.str, tok.len, setting) == 0 ||
+      *setting < minimum) {
+    parse_error(p, keyword->str, "%.*s needs a %s", keyword->len, keyword->str,
+		minimum > 0 ? "time in ms" : "count");
+    *setting = 0;
+  }
+}
+
+void
+parse_config(config_parser *p)
 {
-  struct stat buf;
-  char *home;
-  char *line;
   char *s;
-  char *name;
-  char *regex;
-  char *tok;
-  char *which_key;
-  char *updown;
-  char delim;
+  config_token tok;
   translation *tr = NULL;
-  FILE *f;
 
-  if (config_file_name == NULL) {
-    config_file_name = getenv("SHUTTLE_CONFIG_FILE");
-    if (config_file_name == NULL) {
-      home = getenv("HOME");
-      config_file_name = alloc_strcat(home, "/.shuttlerc");
-    } else {
-      config_file_name = alloc_strcat(config_file_name, NULL);
+  while (next_line(p)) {
+    s = p->line;
+    while (s < p->line_end && isspace((unsigned char)*s)) {
+      s++;
+    }
+    if (s < p->line_end && *s == '#') {
+      continue;
+    }
+    if (s < p->line_end && *s == '[') {
+      tr = parse_section_header(p, s);
+      continue;
+    }
+
+    p->pos = s;
+    if (!next_token(p, &tok)) {
+      continue;
+    }
+    if (token_is(&tok, "include") || token_is(&tok, "include_dir")) {
+      parse_include(p, &tok);
+      tr = NULL; // bindings after an include need a new section
+      continue;
+    }
+    if (!p->frag->is_main && is_setting(&tok)) {
+      parse_error(p, tok.str, "%.*s only works in the main config file", tok.len, tok.str);
+      continue;
+    }
+    if (token_is(&tok, "DEBUG_REGEX")) {
+      debug_regex = 1;
+    } else if (token_is(&tok, "DEBUG_STROKES")) {
+      debug_strokes = 1;
+    } else if (token_is(&tok, "DEBUG_GESTURES")) {
+      settings.debug_gestures = 1;
+    } else if (token_is(&tok, "HOLD_TIME")) {
+      parse_setting(p, &tok, &settings.hold_time, 1);
+    } else if (token_is(&tok, "DOUBLE_TIME")) {
+      parse_setting(p, &tok, &settings.double_time, 1);
+    } else if (token_is(&tok, "CHORD_TIME")) {
+      parse_setting(p, &tok, &settings.chord_time, 1);
+    } else if (token_is(&tok, "XTEST_DELAYS")) {
+      settings.xtest_delays = 1;
+    } else if (token_is(&tok, "MAX_COMPILED_REGEX")) {
+      parse_setting(p, &tok, &settings.max_compiled_regex, 0);
+    } else if (token_is(&tok, "NO_COALESCE")) {
+      settings.no_coalesce = 1;
+    } else if (token_is(&tok, "EVENT_DEADLINE")) {
+      parse_setting(p, &tok, &settings.event_deadline, 1);
+    } else if (token_is(&tok, "DEBUG_EVENTS")) {
+      settings.debug_events = 1;
+    } else if (token_is(&tok, "JOG_TIMED")) {
+      settings.jog_timed = 1;
+    } else if (token_is(&tok, "TRACE_THRESHOLD")) {
+      parse_setting(p, &tok, &settings.trace_threshold, 1);
+    } else if (token_is(&tok, "JOG_MAX_STEPS")) {
+      parse_setting(p, &tok, &settings.jog_max_steps, 0);
+    } else if (token_is(&tok, "MACRO")) {
+      define_macro(p, &tok);
+    } else if (!start_translation(p, tr, &tok)) {
+      parse_output(p, NULL);
+      finish_translation();
     }
-    config_file_modification_time = 0;
   }
-  if (stat(config_file_name, &buf) < 0) {
-    perror(config_file_name);
-    return;
+  free_macros();
+}
+
+// Every file the config was read from is kept as a fragment, found by
+// name in this table.  On a reload, a fragment whose file has the same
+// modification time and size, or failing that the same contents, is
+// used again as it is.  So editing one included file only re-parses
+// that file, and the sections are then relinked in include order.
+#define FRAGMENT_HASH_SIZE 256
+
+static fragment *fragments[FRAGMENT_HASH_SIZE];
+
+// the files and directories the current config was read from, which
+// are checked on each call to read_config_file()
+typedef struct _watched_file {
+  struct _watched_file *next;
+  char *name;
+  time_t mtime;
+  off_t size;
+} watched_file;
+
+static watched_file *watched = NULL;
+
+void
+watch_file(char *name, struct stat *st)
+{
+  watched_file *w = (watched_file *)allocate(sizeof(watched_file));
+
+  w->name = alloc_strcat(name, NULL);
+  w->mtime = st->st_mtime;
+  w->size = st->st_size;
+  w->next = watched;
+  watched = w;
+}
+
+void
+free_watched_files(void)
+{
+  watched_file *w;
+
+  while (watched != NULL) {
+    w = watched;
+    watched = w->next;
+    free(w->name);
+    free(w);
   }
-  if (buf.st_mtime == 0) {
-    buf.st_mtime = 1;
+}
+
+// returns 1 if any of the files or directories has changed
+int
+config_changed(void)
+{
+  struct stat st;
+  watched_file *w;
+
+  if (watched == NULL) {
+    return 1;
+  }
+  for (w = watched; w != NULL; w = w->next) {
+    if (stat(w->name, &st) < 0 || st.st_mtime != w->mtime || st.st_size != w->size) {
+      return 1;
+    }
   }
-  if (buf.st_mtime > config_file_modification_time) {
-    config_file_modification_time = buf.st_mtime;
+  return 0;
+}
 
-    f = fopen(config_file_name, "r");
-    if (f == NULL) {
-      perror(config_file_name);
-      return;
+fragment **
+find_fragment(char *file_name)
+{
+  fragment **fp = &fragments[hash_string(file_name) % FRAGMENT_HASH_SIZE];
+
+  while (*fp != NULL && strcmp((*fp)->file_name, file_name)) {
+    fp = &(*fp)->hash_next;
+  }
+  return fp;
+}
+
+void
+free_dir_files(fragment_item *item)
+{
+  while (item->dir_count > 0) {
+    free(item->dir_files[--item->dir_count]);
+  }
+  free(item->dir_files);
+  item->dir_files = NULL;
+}
+
+void
+free_items(fragment_item *items)
+{
+  fragment_item *item;
+
+  while (items != NULL) {
+    item = items;
+    items = item->next;
+    free_translation_section(item->section);
+    free(item->include);
+    free_dir_files(item);
+    free(item);
+  }
+}
+
+void
+free_fragment_items(fragment *f)
+{
+  free_items(f->items);
+  f->items = NULL;
+  f->items_tail = &f->items;
+  f->has_includes = 0;
+}
+
+// New sections are compiled on the parse workers, and their stroke
+// sequences only interned once the workers are done, on the main
+// thread, in include order.  So the result doesn't depend on which
+// worker finished first.
+void
+intern_section(translation *tr)
+{
+  chord *c;
+  int i;
+
+  for (i=0; i<NUM_KEYS; i++) {
+    tr->key_down[i] = intern_strokes(tr->key_down[i]);
+    tr->key_up[i] = intern_strokes(tr->key_up[i]);
+    tr->hold_down[i] = intern_strokes(tr->hold_down[i]);
+    tr->hold_up[i] = intern_strokes(tr->hold_up[i]);
+    tr->double_down[i] = intern_strokes(tr->double_down[i]);
+    tr->double_up[i] = intern_strokes(tr->double_up[i]);
+  }
+  for (i=0; i<NUM_SHUTTLES; i++) {
+    tr->shuttle[i] = intern_strokes(tr->shuttle[i]);
+  }
+  for (i=0; i<NUM_JOGS; i++) {
+    tr->jog[i] = intern_strokes(tr->jog[i]);
+  }
+  for (c = tr->chords; c != NULL; c = c->next) {
+    c->down = intern_strokes(c->down);
+    c->up = intern_strokes(c->up);
+  }
+}
+
+// one file to be brought up to date by a parse worker
+typedef struct _load_job {
+  fragment *f;
+  int reloaded; // the items were rebuilt
+  int rejected; // but had errors, so the old ones were kept
+  fragment_item *old_items; // the ones to free: replaced or rejected
+} load_job;
+
+// put back the items a reparse with errors replaced, leaving the new
+// ones in the job to be freed
+void
+reject_reparse(load_job *job, int old_has_includes)
+{
+  fragment *f = job->f;
+  fragment_item *rejected = f->items;
+
+  f->items = job->old_items;
+  f->items_tail = &f->items;
+  while (*f->items_tail != NULL) {
+    f->items_tail = &(*f->items_tail)->next;
+  }
+  f->has_includes = old_has_includes;
+  f->parsed = 0; // so the cache isn't written with the old items
+  job->old_items = rejected;
+  job->rejected = 1;
+}
+
+// bring the fragment up to date with its file, parsing it only if it
+// has changed since it was last loaded.  This runs on the parse
+// workers, so it only touches the fragment and the thread's own parse
+// state, and leaves the old items for install_fragment() to free.
+//
+// A file caught in the middle of being saved may be missing, empty or
+// cut short.  So a file which was loaded before keeps its last good
+// contents if it can't be read or is empty, and it's tried again at the
+// next check.  If reparsing it finds errors, the old items are also kept
+// until the file changes again.
+void
+load_fragment(load_job *job)
+{
+  fragment *f = job->f;
+  config_parser parser;
+  struct stat st;
+  unsigned int hash;
+  int old_has_includes = f->has_includes;
+
+  job->reloaded = 0;
+  job->rejected = 0;
+  job->old_items = NULL;
+  f->ok = 0;
+  if (f->has_contents && stat(f->file_name, &st) == 0 &&
+      st.st_mtime == f->st.st_mtime && st.st_size == f->st.st_size) {
+    f->ok = 1;
+    return;
+  }
+  if (!open_config_parser(&parser, f->file_name, &st)) {
+    if (f->has_contents) {
+      fprintf(stderr, "%s: keeping the previous contents\n", f->file_name);
+      f->ok = 1;
     }
+    return;
+  }
+  if (parser.len == 0 && f->has_contents) {
+    fprintf(stderr, "%s: empty, keeping the previous contents\n", f->file_name);
+    close_config_parser(&parser);
+    f->ok = 1;
+    return;
+  }
+  hash = hash_bytes(parser.buf, parser.len, HASH_SEED);
+  f->ok = 1;
+  if (f->has_contents && f->hash == hash) {
+    close_config_parser(&parser);
+    f->st = st;
+    return;
+  }
 
-    free_all_translations();
+  job->reloaded = 1;
+  job->old_items = f->items;
+  f->items = NULL;
+  f->items_tail = &f->items;
+  f->has_includes = 0;
+  f->st = st;
+  f->hash = hash;
+  f->has_contents = 1;
+  parser.frag = f;
+  loading_fragment = f;
+  if (f->is_main) {
     debug_regex = 0;
     debug_strokes = 0;
+    memset(&settings, 0, sizeof(settings));
+  }
+  if (!f->is_main || !load_config_cache(f->file_name, &st, hash)) {
+    if (f->is_main) {
+      free_fragment_items(f);
+      debug_regex = 0;
+      memset(&settings, 0, sizeof(settings));
+    }
+    parse_config(&parser);
+    f->parsed = 1;
+    if (parser.errors > 0 && job->old_items != NULL) {
+      fprintf(stderr, "%s: errors, keeping the previous contents\n", f->file_name);
+      reject_reparse(job, old_has_includes);
+    }
+  }
+  if (f->is_main && !job->rejected) {
+    f->settings = settings;
+    f->debug_regex = debug_regex;
+    f->debug_strokes = debug_strokes;
+  }
+  loading_fragment = NULL;
+  close_config_parser(&parser);
+}
 
-    while ((line=read_line(f, config_file_name)) != NULL) {
-      //printf("line: %s", line);
-      
-      s = line;
-      while (*s && isspace(*s)) {
-	s++;
-      }
-      if (*s == '#') {
-	continue;
+// 0 for one per CPU
+int parse_threads = 0;
+
+#define MAX_PARSE_THREADS 8
+
+typedef struct _load_queue {
+  load_job *jobs;
+  int count;
+  int next;
+  pthread_mutex_t lock;
+} load_queue;
+
+void *
+parse_worker(void *arg)
+{
+  load_queue *q = (load_queue *)arg;
+  int i;
+
+  while (1) {
+    pthread_mutex_lock(&q->lock);
+    i = q->next++;
+    pthread_mutex_unlock(&q->lock);
+    if (i >= q->count) {
+      return NULL;
+    }
+    load_fragment(&q->jobs[i]);
+  }
+}
+
+// the most threads a load uses, including the calling one
+int
+max_parse_threads(void)
+{
+  int num_threads = parse_threads;
+
+  if (num_threads <= 0) {
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (num_threads > MAX_PARSE_THREADS) {
+    num_threads = MAX_PARSE_THREADS;
+  }
+  return num_threads;
+}
+
+// load the fragments on up to max_parse_threads() threads
+void
+run_load_jobs(load_job *jobs, int count)
+{
+  pthread_t threads[MAX_PARSE_THREADS];
+  load_queue q;
+  int num_threads = max_parse_threads();
+  int started = 0;
+  int i;
+
+  if (num_threads > count) {
+    num_threads = count;
+  }
+  if (debug_strokes) {
+    num_threads = 1; // keep the output in order
+  }
+  q.jobs = jobs;
+  q.count = count;
+  q.next = 0;
+  pthread_mutex_init(&q.lock, NULL);
+  for (i=1; i<num_threads; i++) {
+    if (pthread_create(&threads[started], NULL, parse_worker, &q) != 0) {
+      break;
+    }
+    started++;
+  }
+  parse_worker(&q);
+  for (i=0; i<started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_mutex_destroy(&q.lock);
+}
+
+// back on the main thread: free what a reparse replaced, and intern
+// the new sequences
+void
+install_fragment(load_job *job)
+{
+  fragment *f = job->f;
+  fragment_item *item;
+
+  if (job->rejected) {
+    // so the sweep frees their stroke sequences
+    for (item = job->old_items; item != NULL; item = item->next) {
+      if (item->section != NULL) {
+	intern_section(item->section);
       }
-      if (*s == '[') {
-	//  [name] regex\n
-	name = ++s;
-	while (*s && *s != ']') {
-	  s++;
-	}
-	regex = NULL;
-	if (*s) {
-	  *s = '\0';
-	  s++;
-	  while (*s && isspace(*s)) {
-	    s++;
-	  }
-	  regex = s;
-	  while (*s) {
-	    s++;
-	  }
-	  s--;
-	  while (s > regex && isspace(*s)) {
-	    s--;
-	  }
-	  s[1] = '\0';
-	}
-	tr = new_translation_section(name, regex);
-	continue;
+    }
+  }
+  free_items(job->old_items);
+  job->old_items = NULL;
+  if (!f->ok) {
+    return;
+  }
+  if (job->reloaded && !job->rejected) {
+    for (item = f->items; item != NULL; item = item->next) {
+      if (item->section != NULL) {
+	intern_section(item->section);
       }
+    }
+  }
+  watch_file(f->file_name, &f->st);
+  if (f->is_main) {
+    settings = f->settings;
+    debug_regex = f->debug_regex;
+    debug_strokes = f->debug_strokes;
+  }
+}
 
-      tok = token(s, &delim);
-      if (tok == NULL) {
-	continue;
-      }
-      if (!strcmp(tok, "DEBUG_REGEX")) {
-	debug_regex = 1;
-	continue;
+// add the file to the list of jobs, unless it's already on it
+fragment *
+queue_fragment(char *file_name, load_job **jobs, int *count, int *size)
+{
+  fragment **fp = find_fragment(file_name);
+  fragment *f = *fp;
+
+  if (f == NULL) {
+    f = (fragment *)allocate(sizeof(fragment));
+    memset(f, 0, sizeof(*f));
+    f->file_name = alloc_strcat(file_name, NULL);
+    f->items_tail = &f->items;
+    *fp = f;
+  }
+  if (!f->loaded) {
+    f->loaded = 1;
+    if (*count == *size) {
+      *size = *size ? *size * 2 : 16;
+      *jobs = (load_job *)realloc(*jobs, *size * sizeof(load_job));
+      if (*jobs == NULL) {
+	fprintf(stderr, "Out of memory!\n");
+	exit(1);
       }
-      if (!strcmp(tok, "DEBUG_STROKES")) {
-	debug_strokes = 1;
-	continue;
+    }
+    (*jobs)[(*count)++].f = f;
+  }
+  return f;
+}
+
+int
+compare_names(const void *a, const void *b)
+{
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+// list the files in an include_dir directory in name order, skipping
+// hidden files and editor backups
+void
+list_include_dir(fragment_item *item)
+{
+  DIR *dir;
+  struct dirent *ent;
+  struct stat st;
+  char *name;
+  int size = 0;
+  int len;
+
+  free_dir_files(item);
+  dir = opendir(item->include);
+  if (dir == NULL) {
+    perror(item->include);
+    return;
+  }
+  if (fstat(dirfd(dir), &st) == 0) {
+    watch_file(item->include, &st);
+  }
+  while ((ent = readdir(dir)) != NULL) {
+    len = strlen(ent->d_name);
+    if (ent->d_name[0] == '.' || ent->d_name[0] == '#' || ent->d_name[len-1] == '~') {
+      continue;
+    }
+    name = allocate(strlen(item->include) + len + 2);
+    sprintf(name, "%s/%s", item->include, ent->d_name);
+    if (stat(name, &st) < 0 || !S_ISREG(st.st_mode)) {
+      free(name);
+      continue;
+    }
+    if (item->dir_count == size) {
+      size = size ? size * 2 : 16;
+      item->dir_files = (char **)realloc(item->dir_files, size * sizeof(char *));
+      if (item->dir_files == NULL) {
+	fprintf(stderr, "Out of memory!\n");
+	exit(1);
       }
-      which_key = tok;
-      if (start_translation(tr, which_key)) {
+    }
+    item->dir_files[item->dir_count++] = name;
+  }
+  closedir(dir);
+  qsort(item->dir_files, item->dir_count, sizeof(char *), compare_names);
+}
+
+// Load the main file, then everything it includes, then everything
+// those include, and so on.  Each wave of files is loaded in parallel.
+fragment *
+load_all_fragments(char *main_file_name)
+{
+  load_job *jobs = NULL;
+  int count = 0;
+  int size = 0;
+  int start = 0;
+  int end;
+  int i;
+  int j;
+  fragment *main_fragment;
+  fragment_item *item;
+
+  main_fragment = queue_fragment(main_file_name, &jobs, &count, &size);
+  main_fragment->is_main = 1;
+  while (start < count) {
+    end = count;
+    run_load_jobs(jobs + start, end - start);
+    for (i=start; i<end; i++) {
+      install_fragment(&jobs[i]);
+    }
+    for (i=start; i<end; i++) {
+      if (!jobs[i].f->ok) {
 	continue;
       }
-      tok = token(NULL, &delim);
-      while (tok != NULL) {
-	if (delim != '"' && tok[0] == '#') {
-	  break; // skip rest as comment
+      for (item = jobs[i].f->items; item != NULL; item = item->next) {
+	if (item->include == NULL) {
+	  continue;
 	}
-	//printf("token: [%s] delim [%d]\n", tok, delim);
-	switch (delim) {
-	case ' ':
-	case '\t':
-	case '\n':
-	  add_keystroke(tok, PRESS_RELEASE);
-	  break;
-	case '"':
-	  add_string(tok);
-	  break;
-	default: // should be slash
-	  updown = token(NULL, &delim);
-	  if (updown != NULL) {
-	    switch (updown[0]) {
-	    case 'U':
-	      add_keystroke(tok, RELEASE);
-	      break;
-	    case 'D':
-	      add_keystroke(tok, PRESS);
-	      break;
-	    case 'H':
-	      add_keystroke(tok, HOLD);
-	      break;
-	    default:
-	      fprintf(stderr, "invalid up/down modifier [%s]%s: %s\n", name, which_key, updown);
-	      add_keystroke(tok, PRESS);
-	      break;
-	    }
-	  }
+	if (!item->is_dir) {
+	  queue_fragment(item->include, &jobs, &count, &size);
+	  continue;
+	}
+	list_include_dir(item);
+	for (j=0; j<item->dir_count; j++) {
+	  queue_fragment(item->dir_files[j], &jobs, &count, &size);
 	}
-	tok = token(NULL, &delim);
       }
-      finish_translation();
     }
+    start = end;
+  }
+  free(jobs);
+  return main_fragment->ok ? main_fragment : NULL;
+}
+
+void link_fragment(fragment *f);
+
+void
+link_include(char *file_name)
+{
+  fragment *f = *find_fragment(file_name);
+
+  if (f != NULL && f->ok) {
+    link_fragment(f);
+  }
+}
+
+// add the fragment's sections to the translation list, along with
+// those of the fragments it includes where it includes them
+void
+link_fragment(fragment *f)
+{
+  fragment_item *item;
+  int i;
+
+  if (f->linked) {
+    fprintf(stderr, "%s: included more than once\n", f->file_name);
+    return;
+  }
+  f->linked = 1;
+  for (item = f->items; item != NULL; item = item->next) {
+    if (item->section != NULL) {
+      link_translation_section(item->section);
+    } else if (item->is_dir) {
+      for (i=0; i<item->dir_count; i++) {
+	link_include(item->dir_files[i]);
+      }
+    } else {
+      link_include(item->include);
+    }
+  }
+}
+
+void
+read_config_file(void)
+{
+  struct stat buf;
+  char *home;
+  fragment *main_fragment;
+  fragment **fp;
+  fragment *f;
+  int i;
+
+  if (config_file_name == NULL) {
+    config_file_name = getenv("SHUTTLE_CONFIG_FILE");
+    if (config_file_name == NULL) {
+      home = getenv("HOME");
+      config_file_name = alloc_strcat(home, "/.shuttlerc");
+    } else {
+      config_file_name = alloc_strcat(config_file_name, NULL);
+    }
+  }
+  if (stat(config_file_name, &buf) < 0) {
+    perror(config_file_name);
+    return;
+  }
+  if (!config_changed()) {
+    return;
+  }
+
+  if (config_reload_hook != NULL) {
+    config_reload_hook();
+  }
+  stat_add(STAT_RELOADS, 1);
+  free_watched_files();
+  init_keysym_hash();
+
+  // files which can't be read keep what they had, so the new config
+  // is only linked in once it's all loaded
+  main_fragment = load_all_fragments(config_file_name);
+  clear_title_cache();
+  unlink_all_translations();
+  if (main_fragment != NULL) {
+    link_fragment(main_fragment);
+  }
+
+  // drop the fragments which are no longer part of the config
+  for (i=0; i<FRAGMENT_HASH_SIZE; i++) {
+    fp = &fragments[i];
+    while ((f = *fp) != NULL) {
+      if (f->linked) {
+	fp = &f->hash_next;
+      } else {
+	*fp = f->hash_next;
+	free_fragment_items(f);
+	free(f->file_name);
+	free(f);
+      }
+    }
+  }
+  sweep_interned_strokes();
 
-    fclose(f);
+  // the binary cache can only stand in for a single file
+  if (main_fragment != NULL && main_fragment->parsed && !main_fragment->has_includes) {
+    write_config_cache(config_file_name, &main_fragment->st, main_fragment->hash);
+  }
+  for (i=0; i<FRAGMENT_HASH_SIZE; i++) {
+    for (f = fragments[i]; f != NULL; f = f->hash_next) {
+      f->loaded = 0;
+      f->parsed = 0;
+      f->linked = 0;
+    }
+  }
+}
 
+int
+translation_matches(translation *tr, char *win_title, size_t title_len)
+{
+  switch (tr->match_type) {
+  case MATCH_EXACT:
+    return title_len == tr->literal_len &&
+      !memcmp(win_title, tr->literal, title_len);
+  case MATCH_PREFIX:
+    return title_len >= tr->literal_len &&
+      !memcmp(win_title, tr->literal, tr->literal_len);
+  case MATCH_SUBSTRING:
+    return strstr(win_title, tr->literal) != NULL;
+  case MATCH_CLASS:
+  case MATCH_EXE:
+    return 0; // only found through the hash tables
+  case MATCH_REGEX:
+  default:
+    if (!compile_regex(tr)) {
+      return 0;
+    }
+    stat_add(STAT_REGEX_EVALUATIONS, 1);
+    return regexec(&tr->regex, win_title, 0, NULL, 0) == 0;
   }
 }
 
+// the first section in config order which matches.  An exact title
+// match comes from the hash table, and only the sections which have to
+// be tried in turn and come before it are checked.
 translation *
-get_translation(char *win_title)
+scan_translations(char *win_title)
 {
+  translation *exact;
   translation *tr;
+  size_t title_len;
 
-  read_config_file();
-  tr = first_translation_section;
-  while (tr != NULL) {
-    if (tr->is_default) {
-      return tr;
+  title_len = strlen(win_title);
+  exact = lookup_section_hash(exact_sections, win_title);
+  for (tr = first_scan_section; tr != NULL; tr = tr->scan_next) {
+    if (exact != NULL && tr->order > exact->order) {
+      break;
     }
-    if (regexec(&tr->regex, win_title, 0, NULL, 0) == 0) {
+    if (tr->is_default || translation_matches(tr, win_title, title_len)) {
       return tr;
     }
-    tr = tr->next;
   }
-  return NULL;
+  return exact;
+}
+
+translation *
+get_title_translation(char *win_title)
+{
+  title_cache_entry *cached;
+  translation *tr;
+  unsigned int hash;
+
+  hash = hash_string(win_title);
+  cached = lookup_title_cache(win_title, hash);
+  if (cached != NULL) {
+    return cached->tr;
+  }
+  tr = scan_translations(win_title);
+  add_title_cache(win_title, hash, tr);
+  return tr;
+}
+
+translation *
+get_translation(char *win_title)
+{
+  read_config_file();
+  return get_title_translation(win_title);
+}
+
+// look up the translation for a window, trying class= and exe= sections
+// before falling back to the title.  The caller is expected to have
+// called read_config_file() already, so that it knows from
+// have_class_sections and have_exe_sections which fields are worth
+// filling in.
+translation *
+get_window_translation(window_info *info)
+{
+  translation *tr = NULL;
+
+  if (have_class_sections) {
+    tr = lookup_section_hash(class_sections, info->instance);
+    if (tr == NULL) {
+      tr = lookup_section_hash(class_sections, info->class);
+    }
+  }
+  if (tr == NULL && have_exe_sections) {
+    tr = lookup_section_hash(exe_sections, info->comm);
+    if (tr == NULL) {
+      tr = lookup_section_hash(exe_sections, info->exe);
+    }
+  }
+  if (tr == NULL && info->title != NULL) {
+    tr = get_title_translation(info->title);
+  }
+  return tr;
 }
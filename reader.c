@@ -0,0 +1,306 @@
+
+/*
+
+  Copyright 2013 Eric Messick (FixedImagePhoto.com/Contact)
+
+  Device reading thread
+
+  Events are read from the ShuttlePRO on a thread of their own and
+  passed to the main thread, which owns the X connection and does all
+  of the output, through a single producer, single consumer ring.  So
+  when the X server is slow to take our requests, we still drain the
+  kernel's evdev buffer as fast as events arrive, and none are lost
+  there.
+
+  The ring needs no locks: only the reader writes ring_head, and only
+  the main thread writes ring_tail.  The reader wakes the main thread's
+  poll() through an eventfd.
+
+  Events get their timestamps from the kernel, on the monotonic clock
+  now_ms() uses, or if the kernel can't do that, from the reader as it
+  reads them.  Only key and jog/shuttle events are passed on.  From a
+  hidraw device, the events are decoded from HID reports by hidraw.c.
+
+  If the ring fills up, key events wait for the main thread to make
+  room, so a press or release is never lost.  Jog and shuttle events
+  carry absolute positions, so the newest one of each is held back
+  until there's room, replacing any held before it.  Only the steps in
+  between are lost, and the wheels still end up where they really are.
+
+ */
+
+#include "shuttle.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+
+#define EVENT_RING_SIZE 1024 // a power of two
+#define READ_BATCH 64
+#define HELD_RETRY_MS 1 // how often held events are tried again
+#define KEY_WAIT_NS 100000 // and a key event waiting for room
+
+static struct input_event ring[EVENT_RING_SIZE];
+static atomic_uint ring_head; // next slot the reader fills
+static atomic_uint ring_tail; // next slot the main thread takes
+static atomic_int reader_done;
+
+static int device_fd;
+static int wakeup_fd = -1;
+static int kernel_timestamps;
+static pthread_t reader_thread;
+
+// jog and shuttle events which didn't fit in the ring, oldest first,
+// at most one of each
+static struct input_event held[2];
+static int num_held = 0;
+
+void
+wake_main_thread(void)
+{
+  uint64_t one = 1;
+
+  if (write(wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    perror("eventfd write");
+  }
+}
+
+// make the main thread's poll() return, from a signal handler.  It's
+// only a write(), so it's safe there, and it doesn't change errno.
+void
+wake_from_signal(void)
+{
+  uint64_t one = 1;
+  int saved_errno = errno;
+
+  if (wakeup_fd >= 0 && write(wakeup_fd, &one, sizeof(one)) < 0) {
+    // full already, which wakes it just the same
+  }
+  errno = saved_errno;
+}
+
+// read the next events from the device into batch, which has room for
+// READ_BATCH.  returns the count, or -1 once the device can't be read.
+int
+read_device(struct input_event *batch)
+{
+  unsigned char report[HID_REPORT_SIZE];
+  ssize_t n;
+  int count;
+
+  do {
+    if (hidraw_device) {
+      n = read(device_fd, report, sizeof(report));
+    } else {
+      n = read(device_fd, batch, READ_BATCH * sizeof(batch[0]));
+    }
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    perror("read event");
+    return -1;
+  }
+  if (hidraw_device) {
+    count = decode_hid_report(report, n, batch);
+    if (count < 0) {
+      fprintf(stderr, "short report: %d\n", (int)n);
+    }
+    return count;
+  }
+  if (n == 0 || n % sizeof(batch[0]) != 0) {
+    fprintf(stderr, "short read: %d\n", (int)n);
+    return -1;
+  }
+  return n / sizeof(batch[0]);
+}
+
+// returns 1 if the device has something to read within ms
+int
+device_readable(int ms)
+{
+  struct pollfd pfd;
+
+  pfd.fd = device_fd;
+  pfd.events = POLLIN;
+  return poll(&pfd, 1, ms) != 0;
+}
+
+// put ev in the ring.  tail is the reader's copy of ring_tail, only
+// reloaded when the ring looks full.  returns 0 if there's no room.
+int
+put_event(struct input_event *ev, unsigned int *head, unsigned int *tail)
+{
+  if (*head - *tail == EVENT_RING_SIZE) {
+    *tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+    if (*head - *tail == EVENT_RING_SIZE) {
+      return 0;
+    }
+  }
+  ring[*head & (EVENT_RING_SIZE - 1)] = *ev;
+  (*head)++;
+  return 1;
+}
+
+// move held events into the ring, as far as there's room.  returns 1
+// once none are left.
+int
+put_held_events(unsigned int *head, unsigned int *tail)
+{
+  while (num_held > 0) {
+    if (!put_event(&held[0], head, tail)) {
+      return 0;
+    }
+    held[0] = held[1];
+    num_held--;
+  }
+  return 1;
+}
+
+// hold a jog or shuttle event until there's room, in place of an older
+// one with the same code
+void
+hold_event(struct input_event *ev)
+{
+  if (num_held > 0 && held[0].code == ev->code) {
+    held[0] = held[1];
+    num_held--;
+    stat_add(STAT_EVENTS_DROPPED, 1);
+  } else if (num_held > 1 && held[1].code == ev->code) {
+    num_held--;
+    stat_add(STAT_EVENTS_DROPPED, 1);
+  }
+  held[num_held++] = *ev;
+}
+
+void *
+read_events(void *arg)
+{
+  struct input_event batch[READ_BATCH];
+  struct timespec ts;
+  struct timespec key_wait = { 0, KEY_WAIT_NS };
+  unsigned int head;
+  unsigned int tail;
+  unsigned int published;
+  int count;
+  int i;
+
+  (void)arg;
+  head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+  tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+  published = head;
+  while (1) {
+    // held events mustn't wait for the next one from the device
+    if (num_held > 0 && !device_readable(HELD_RETRY_MS)) {
+      count = 0;
+    } else if ((count = read_device(batch)) < 0) {
+      break;
+    }
+    if (count > 0 && !kernel_timestamps) {
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+    }
+    for (i=0; i<count; i++) {
+      if (batch[i].type != EVENT_TYPE_KEY && batch[i].type != EVENT_TYPE_JOGSHUTTLE) {
+	continue;
+      }
+      if (!kernel_timestamps) {
+	batch[i].time.tv_sec = ts.tv_sec;
+	batch[i].time.tv_usec = ts.tv_nsec / 1000;
+      }
+      if (batch[i].type == EVENT_TYPE_JOGSHUTTLE) {
+	if (!put_held_events(&head, &tail) || !put_event(&batch[i], &head, &tail)) {
+	  hold_event(&batch[i]);
+	}
+	continue;
+      }
+      while (!put_held_events(&head, &tail) || !put_event(&batch[i], &head, &tail)) {
+	atomic_store_explicit(&ring_head, head, memory_order_release);
+	published = head;
+	wake_main_thread();
+	nanosleep(&key_wait, NULL);
+      }
+    }
+    put_held_events(&head, &tail);
+    if (head != published) {
+      atomic_store_explicit(&ring_head, head, memory_order_release);
+      published = head;
+      wake_main_thread();
+    }
+  }
+  atomic_store_explicit(&reader_done, 1, memory_order_release);
+  wake_main_thread();
+  return NULL;
+}
+
+// start reading the device, which is already open, and grabbed unless
+// it's a hidraw device.
+// returns the file descriptor to poll() for events, or -1.
+int
+start_reader(int fd)
+{
+  int clock = CLOCK_MONOTONIC;
+  sigset_t all, old;
+  int err;
+
+  if (wakeup_fd < 0) {
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd < 0) {
+      perror("eventfd");
+      return -1;
+    }
+  }
+  device_fd = fd;
+  kernel_timestamps = !hidraw_device && ioctl(fd, EVIOCSCLOCKID, &clock) == 0;
+  atomic_store(&ring_head, 0);
+  atomic_store(&ring_tail, 0);
+  atomic_store(&reader_done, 0);
+  // positions held back from the last device mean nothing on this one
+  num_held = 0;
+  // leave signals to the main thread, so they wake up its poll()
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  err = pthread_create(&reader_thread, NULL, read_events, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err != 0) {
+    fprintf(stderr, "can't start reader thread\n");
+    return -1;
+  }
+  return wakeup_fd;
+}
+
+// take the next event from the ring.  returns 0 if it's empty.
+int
+next_event(struct input_event *ev)
+{
+  unsigned int tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+  uint64_t count;
+
+  if (tail == atomic_load_explicit(&ring_head, memory_order_acquire)) {
+    // clear the wakeup, then look again in case an event just arrived
+    if (read(wakeup_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+      perror("eventfd read");
+    }
+    if (tail == atomic_load_explicit(&ring_head, memory_order_acquire)) {
+      return 0;
+    }
+  }
+  *ev = ring[tail & (EVENT_RING_SIZE - 1)];
+  atomic_store_explicit(&ring_tail, tail + 1, memory_order_release);
+  return 1;
+}
+
+// returns 1 once the reader has stopped and every event it read has
+// been taken, after waiting for the thread to finish.  The device then
+// needs to be reopened.
+int
+reader_stopped(void)
+{
+  if (!atomic_load_explicit(&reader_done, memory_order_acquire) ||
+      atomic_load_explicit(&ring_tail, memory_order_relaxed) !=
+      atomic_load_explicit(&ring_head, memory_order_acquire)) {
+    return 0;
+  }
+  pthread_join(reader_thread, NULL);
+  return 1;
+}
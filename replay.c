@@ -0,0 +1,231 @@
+/*
+
+  Copyright 2013 Eric Messick (FixedImagePhoto.com/Contact)
+
+  Replay of recorded device traces
+
+  shuttlepro --replay [-n COUNT] <trace>... runs the events in each
+  trace, COUNT times over (default once), through
+  handle_event() with no X display.  Strokes go to a null output sink,
+  which only counts them, and the focused window is whatever the trace
+  last said it was.  Events are handled as fast as they can be, with
+  their timestamps moved to the time of the replay, so the jog and
+  shuttle timing works as it did when they were recorded.  Timers still
+  run on the real clock, so a replay is over before any :hold or
+  delay= wait is up, and those are settled at the end of each trace.
+
+  A trace is a text file of lines like
+
+  # a comment
+  focus Cinelerra: Program
+  1500 2 7 42
+
+  A focus line switches to a new window with the rest of the line as
+  its title.  The others are events: the time in microseconds from the
+  start of the trace, then the type, code and value of the
+  input_event, as described in shuttle.h.
+
+  For each trace, the time per event and the number of strokes sent
+  are printed, followed by a total over all of them.  When built with
+  COUNT_ALLOCS (make shuttlepro-allocs), heap allocations are counted
+  too, and the replay fails if handling an event without a focus
+  change allocated anything.
+
+ */
+
+#include "shuttle.h"
+
+#define TRACE_LINE_SIZE 1024
+
+typedef struct _trace_record {
+  char *focus; // title for a focus line, NULL for an event
+  long long usec;
+  int line_num;
+  unsigned short type;
+  unsigned short code;
+  int value;
+} trace_record;
+
+Window replay_window = 0; // changes with each focus line
+char *replay_title = NULL;
+
+// totals over all the traces
+static long total_events = 0;
+static long long total_ns = 0;
+
+// read the whole trace, so the replay itself doesn't touch the file.
+// returns the number of records, or -1 on error.
+int
+load_trace(char *file_name, trace_record **records)
+{
+  FILE *f = fopen(file_name, "r");
+  char line[TRACE_LINE_SIZE];
+  trace_record *r;
+  trace_record *new_records;
+  int count = 0;
+  int size = 1024;
+  int line_num = 0;
+  unsigned int type, code;
+  char *s;
+
+  if (f == NULL) {
+    perror(file_name);
+    return -1;
+  }
+  *records = (trace_record *)allocate(size * sizeof(trace_record));
+  while (fgets(line, sizeof(line), f) != NULL) {
+    line_num++;
+    line[strcspn(line, "\n")] = '\0';
+    s = line + strspn(line, " \t");
+    if (*s == '\0' || *s == '#') {
+      continue;
+    }
+    if (count == size) {
+      new_records = (trace_record *)allocate(2 * size * sizeof(trace_record));
+      memcpy(new_records, *records, size * sizeof(trace_record));
+      free(*records);
+      *records = new_records;
+      size *= 2;
+    }
+    r = &(*records)[count];
+    r->line_num = line_num;
+    r->focus = NULL;
+    if (!strncmp(s, "focus ", 6)) {
+      r->focus = alloc_strcat(s + 6, NULL);
+    } else if (sscanf(s, "%lld %u %u %d", &r->usec, &type, &code, &r->value) == 4) {
+      r->type = type;
+      r->code = code;
+    } else {
+      fprintf(stderr, "%s:%d: bad trace line: %s\n", file_name, line_num, s);
+      fclose(f);
+      return -1;
+    }
+    count++;
+  }
+  fclose(f);
+  return count;
+}
+
+void
+free_trace(trace_record *records, int count)
+{
+  int i;
+
+  for (i=0; i<count; i++) {
+    free(records[i].focus);
+  }
+  free(records);
+}
+
+// returns 1 if the trace replayed cleanly
+int
+replay_trace(char *file_name, int repeat)
+{
+  trace_record *records;
+  trace_record *r;
+  struct input_event ev;
+  struct timespec base;
+  long long start, elapsed;
+  long long usec;
+  unsigned long strokes = stat_get(STAT_STROKES);
+  int count;
+  int events = 0;
+  int focus_changes = 0;
+  int pass;
+  int i;
+  int ok = 1;
+#ifdef COUNT_ALLOCS
+  unsigned long allocs;
+  unsigned long steady_allocs = 0;
+#endif
+
+  count = load_trace(file_name, &records);
+  if (count < 0) {
+    return 0;
+  }
+  memset(&ev, 0, sizeof(ev));
+  elapsed = 0;
+  for (pass=0; pass<repeat; pass++) {
+    clock_gettime(CLOCK_MONOTONIC, &base);
+    start = now_ns();
+    for (i=0; i<count; i++) {
+      r = &records[i];
+      if (r->focus != NULL) {
+	replay_window++;
+	replay_title = r->focus;
+	focus_changes++;
+	continue;
+      }
+      usec = base.tv_nsec / 1000 + r->usec;
+      ev.time.tv_sec = base.tv_sec + usec / 1000000;
+      ev.time.tv_usec = usec % 1000000;
+      ev.type = r->type;
+      ev.code = r->code;
+      ev.value = r->value;
+#ifdef COUNT_ALLOCS
+      allocs = alloc_count;
+#endif
+      handle_event(ev);
+      run_timed_macros();
+#ifdef COUNT_ALLOCS
+      allocs = alloc_count - allocs;
+      if (!focus_changed && allocs > 0) {
+	if (steady_allocs == 0) {
+	  fprintf(stderr, "%s:%d: %lu allocations with unchanged focus\n",
+		  file_name, r->line_num, allocs);
+	}
+	steady_allocs += allocs;
+      }
+#endif
+      check_trace_dump();
+      events++;
+    }
+    elapsed += now_ns() - start;
+    // settle whatever is still held, before the titles go away
+    before_config_reload();
+  }
+  total_events += events;
+  total_ns += elapsed;
+
+  printf("%-32s %8d events %6d focus %8lu strokes %10.1f ns/event",
+	 file_name, events, focus_changes, stat_get(STAT_STROKES) - strokes,
+	 events > 0 ? (double)elapsed / events : 0.0);
+#ifdef COUNT_ALLOCS
+  printf(" %6lu steady allocs", steady_allocs);
+  ok = steady_allocs == 0;
+#endif
+  printf("\n");
+  fflush(stdout);
+  free_trace(records, count);
+  replay_title = NULL;
+  return ok;
+}
+
+// takes the arguments after --replay.  returns 1 if every trace
+// replayed cleanly.
+int
+replay_traces(int count, char **args)
+{
+  int repeat = 1;
+  int ok = 1;
+  int i;
+
+  if (count >= 2 && !strcmp(args[0], "-n")) {
+    repeat = atoi(args[1]);
+    args += 2;
+    count -= 2;
+  }
+  if (count < 1 || repeat < 1) {
+    fprintf(stderr, "usage: shuttlepro --replay [-n COUNT] <trace>...\n");
+    return 0;
+  }
+  read_config_file();
+  for (i=0; i<count; i++) {
+    if (!replay_trace(args[i], repeat)) {
+      ok = 0;
+    }
+  }
+  printf("%-32s %8ld events %10.1f ns/event\n", "total", total_events,
+	 total_events > 0 ? (double)total_ns / total_events : 0.0);
+  return ok;
+}
@@ -8,23 +8,30 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <limits.h>
 
 #include <linux/input.h>
 
+#include <time.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include <regex.h>
+#include <stdatomic.h>
 
 #include <X11/Xlib.h>
 #include <X11/extensions/XTest.h>
 #include <X11/keysym.h>
 #include <X11/Xatom.h>
+#include <X11/Xutil.h>
 
 
 // delay in ms before processing each XTest event
-// CurrentTime means no delay
+// CurrentTime means no delay.  With XTEST_DELAYS in the config file,
+// the delay= values from the output sequences are used instead.
 #define DELAY CurrentTime
 
 // protocol for events from the shuttlepro HUD device
@@ -73,22 +80,225 @@ typedef struct _stroke {
   struct _stroke *next;
   KeySym keysym;
   int press; // zero -> release, non-zero -> press
+  int delay; // ms to wait before sending this stroke
 } stroke;
 
+// each release sequence is numbered one more than its press sequence
 #define KJS_KEY_DOWN 1
 #define KJS_KEY_UP 2
 #define KJS_SHUTTLE 3
 #define KJS_JOG 4
+#define KJS_HOLD_DOWN 5
+#define KJS_HOLD_UP 6
+#define KJS_DOUBLE_DOWN 7
+#define KJS_DOUBLE_UP 8
+// for chords, the index is key1 * NUM_KEYS + key2
+#define KJS_CHORD_DOWN 9
+#define KJS_CHORD_UP 10
+
+// a binding for two keys pressed together, K<key1+1>+K<key2+1>
+typedef struct _chord {
+  struct _chord *next;
+  int key1; // key1 < key2, counting from 0
+  int key2;
+  stroke *down;
+  stroke *up;
+} chord;
+
+// how a section's pattern is matched against the window title.  Patterns
+// which are plain strings, optionally anchored with ^ and $, are compared
+// directly instead of going through regexec().
+#define MATCH_REGEX 0
+#define MATCH_EXACT 1     // ^literal$
+#define MATCH_PREFIX 2    // ^literal
+#define MATCH_SUBSTRING 3 // literal
+#define MATCH_CLASS 4     // class=name, WM_CLASS instance or class
+#define MATCH_EXE 5       // exe=name, process comm or executable name
+
+// states of a MATCH_REGEX section's regex, which is compiled the first
+// time it is needed
+#define REGEX_UNCOMPILED 0
+#define REGEX_COMPILED 1
+#define REGEX_BAD 2
 
 typedef struct _translation {
   struct _translation *next;
   char *name;
+  char *pattern; // as written in the section header, NULL for default
   int is_default;
+  int match_type;
+  char *literal; // the pattern text for the non-regex match types
+  size_t literal_len;
   regex_t regex;
+  int regex_state;
+  unsigned long regex_last_used;
+  struct _translation *hash_next; // chain for MATCH_CLASS, MATCH_EXE and MATCH_EXACT
+  struct _translation *scan_next; // the sections titles are tried against in turn
+  int order; // position in the linked config
   stroke *key_down[NUM_KEYS];
   stroke *key_up[NUM_KEYS];
   stroke *shuttle[NUM_SHUTTLES];
   stroke *jog[NUM_JOGS];
+  stroke *hold_down[NUM_KEYS];
+  stroke *hold_up[NUM_KEYS];
+  stroke *double_down[NUM_KEYS];
+  stroke *double_up[NUM_KEYS];
+  int scroll_rate[NUM_SHUTTLES]; // scroll=, wheel detents per second
+  chord *chords;
+  unsigned int gesture_keys; // bit k set if key k has :hold, :double or chords
 } translation;
 
+// what we know about the focused window.  Any of the fields may be NULL.
+typedef struct _window_info {
+  char *title;    // WM_NAME
+  char *instance; // WM_CLASS res_name
+  char *class;    // WM_CLASS res_class
+  char *comm;     // /proc/<_NET_WM_PID>/comm
+  char *exe;      // basename of /proc/<_NET_WM_PID>/exe
+} window_info;
+
+extern int have_class_sections;
+extern int have_exe_sections;
+
+// FNV-1a
+#define HASH_SEED 2166136261u
+
+// numeric settings from the config file.  Everything here is reset to
+// zero before the file is read.
+typedef struct _config_settings {
+  int max_compiled_regex; // 0 for no limit
+  int xtest_delays; // let the X server carry out delay= waits
+  int hold_time; // ms before a press counts as :hold, 0 for default
+  int double_time; // ms to wait for the second press of :double
+  int chord_time; // ms to wait for the other key of a chord
+  int debug_gestures;
+  int no_coalesce; // handle every queued jog and shuttle event
+  int event_deadline; // ms after which queued jog events are dropped, 0 for never
+  int debug_events;
+  int jog_timed; // decode jog jumps by the speed, rather than the shorter way
+  int trace_threshold; // ms from device to handled that dumps the trace, 0 for never
+  int jog_max_steps; // most jog steps one event sends, 0 for default
+} config_settings;
+
+extern config_settings settings;
+
+extern char *allocate(size_t len);
+extern char *alloc_strcat(char *a, char *b);
+extern char *alloc_strndup(char *s, size_t len);
+extern unsigned int hash_bytes(void *data, size_t len, unsigned int hash);
+extern translation *new_translation_section(char *name, size_t name_len,
+					    char *regex, size_t regex_len);
+extern chord *add_chord(translation *tr, int key1, int key2);
+extern int load_config_cache(char *config_name, struct stat *st,
+			     unsigned int source_hash);
+extern void write_config_cache(char *config_name, struct stat *st,
+			       unsigned int source_hash);
+
+extern void (*config_reload_hook)(void);
+
+extern int start_reader(int fd);
+extern int next_event(struct input_event *ev);
+extern int reader_stopped(void);
+extern void wake_from_signal(void);
+
+// jog wheel position tracking, in jogdecode.c
+typedef struct _jog_decoder {
+  int value; // last position, -1 before the first event
+  long long last_usec; // when it was reported
+  double velocity; // steps per usec, averaged, positive clockwise
+  double interval; // usec between reports, averaged, 0 until timed
+} jog_decoder;
+
+extern void reset_jog_decoder(jog_decoder *d);
+extern int decode_jog(jog_decoder *d, unsigned int value, long long usec,
+		      int reports, int use_time);
+
+// the ShuttlePRO's HID reports, from hidraw.c
+#define HID_REPORT_SIZE 64 // enough for any report the device sends
+#define MAX_HID_EVENTS (NUM_KEYS + 2) // events decoded from one report
+extern int hidraw_device;
+extern int is_hidraw(int fd);
+extern void reset_hid_decoder(void);
+extern int decode_hid_report(unsigned char *report, int len,
+			     struct input_event *events);
+
+// smooth scrolling through a uinput wheel, from wheel.c
+#define WHEEL_HI_RES_UNITS 120 // REL_WHEEL_HI_RES units in a detent
+extern int open_hires_wheel(void);
+extern void send_hires_wheel(int units);
+extern void reset_hires_wheel(void);
+
+extern void handle_event(struct input_event ev);
+extern int run_timed_macros(void);
+extern void before_config_reload(void);
+extern int focus_changed;
+extern long long now_ns(void);
+extern int replay_traces(int count, char **file_names);
+
+// Statistics, written out by stats.c.  Each is changed by one thread
+// only, so bumping it is a relaxed load and store, with no locked
+// instruction on the event path, and the stats thread reads them with
+// relaxed loads.  The exception is STAT_PARSE_ERRORS, which parse
+// threads add to with atomic_fetch_add_explicit().
+#define STAT_KEY_EVENTS 0
+#define STAT_JOG_EVENTS 1
+#define STAT_SHUTTLE_EVENTS 2
+#define STAT_STROKES 3 // sent, including to the --replay null sink
+#define STAT_XTEST_REQUESTS 4
+#define STAT_FLUSHES 5
+#define STAT_FOCUS_CHANGES 6
+#define STAT_TITLE_CACHE_HITS 7
+#define STAT_TITLE_CACHE_MISSES 8
+#define STAT_REGEX_EVALUATIONS 9
+#define STAT_RELOADS 10
+#define STAT_PARSE_ERRORS 11
+#define STAT_EVENTS_DROPPED 12 // because the reader's ring was full
+#define STAT_JOG_MERGED 13
+#define STAT_SHUTTLE_SUPERSEDED 14
+#define STAT_JOG_EXPIRED 15
+#define STAT_JOG_STEPS_CAPPED 16
+#define STAT_SECTIONS 17 // gauge
+#define STAT_COMPILED_REGEX 18 // gauge
+#define NUM_STATS 19
+
+extern atomic_ulong stats[NUM_STATS];
+
+#define stat_get(s) atomic_load_explicit(&stats[s], memory_order_relaxed)
+#define stat_set(s, v) atomic_store_explicit(&stats[s], (v), memory_order_relaxed)
+#define stat_add(s, n) stat_set(s, stat_get(s) + (n))
+
+extern void start_stats(void);
+
+// The hot path trace, kept by trace.c.  Only the main thread records
+// entries.
+#define TRACE_EVENT 1 // args: type, code, value, its time in usec (low 32 bits)
+#define TRACE_FOCUS 2 // args: the focused window, 1 if it changed
+#define TRACE_SECTION 3 // name: the section chosen, empty for none
+#define TRACE_STROKES 4 // args: strokes sent for the event
+#define TRACE_FLUSH 5
+#define TRACE_NAME_LEN 16
+
+typedef struct _trace_entry {
+  long long ticks; // of trace_clock(), made into ns when dumped
+  int kind;
+  union {
+    int args[4];
+    char name[TRACE_NAME_LEN]; // not always terminated
+  } u;
+} trace_entry;
+
+extern void start_trace(void);
+extern void trace_point(int kind, int a, int b, int c, int d);
+extern void trace_section(translation *tr);
+extern void trace_event(struct input_event *ev);
+extern void trace_event_done(struct input_event *ev, int strokes);
+extern void check_trace_dump(void);
+
+#ifdef COUNT_ALLOCS
+// heap allocations made by anything in the process, from alloccount.c
+extern unsigned long alloc_count;
+#endif
+
+extern void read_config_file(void);
 extern translation *get_translation(char *win_title);
+extern translation *get_window_translation(window_info *info);
@@ -0,0 +1,409 @@
+/*
+
+ Scaling benchmark for the translation lookup
+
+ Copyright 2013 Eric Messick (FixedImagePhoto.com/Contact)
+
+ Generates synthetic config files with N sections of mixed pattern
+ shapes, and for each N reports the time taken by read_config_file(),
+ the resident memory it added, and the latency of looking up a corpus
+ of realistic window titles both with and without the title cache.
+
+ usage: shuttlebench N...
+        shuttlebench -f FILES N...
+
+ Each N is measured in a separate child process, so the numbers don't
+ depend on what was measured before.
+
+ With -f, the N sections are split across FILES files read through
+ include_dir, and the time to load them is compared between one parse
+ thread and one per CPU.
+
+*/
+
+#include "shuttle.h"
+
+#include <sys/wait.h>
+
+extern void clear_title_cache(void);
+extern int parse_threads;
+extern int max_parse_threads(void);
+
+// how long to keep repeating the lookups for each measurement
+#define LOOKUP_SECONDS 0.2
+
+// titles that don't come from the generated sections, so mostly end up
+// with the default section after scanning everything
+static char *realistic_titles[] = {
+  "Cinelerra: Program",
+  "Cinelerra: Compositor",
+  "report.odt - LibreOffice Writer",
+  "~/src/shuttlepro : bash \342\200\224 Konsole",
+  "Inbox (3) - user@example.com - Mozilla Thunderbird",
+  "GNU Image Manipulation Program",
+  "untitled.blend - Blender",
+  "shuttlepro.c (~/src/shuttlepro) - GVIM",
+  "YouTube - Mozilla Firefox",
+  "-- Unlabeled Window --",
+  NULL
+};
+
+#define NUM_CORPUS 64
+
+static window_info corpus[NUM_CORPUS];
+static char corpus_buf[NUM_CORPUS][2][64];
+static int corpus_size;
+
+double
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+long
+resident_kb(void)
+{
+  FILE *f = fopen("/proc/self/statm", "r");
+  long size = 0, resident = 0;
+
+  if (f != NULL) {
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(f);
+  }
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// section i gets one of five pattern shapes, and the title or class
+// which selects it is written into title
+void
+make_section(FILE *f, int i, char *title)
+{
+  switch (i % 5) {
+  case 0:
+    fprintf(f, "[exact %d] ^App%d: Main$\n", i, i);
+    sprintf(title, "App%d: Main", i);
+    break;
+  case 1:
+    fprintf(f, "[prefix %d] ^Editor%d - \n", i, i);
+    sprintf(title, "Editor%d - file.txt", i);
+    break;
+  case 2:
+    fprintf(f, "[substring %d] doc%d.odt\n", i, i);
+    sprintf(title, "doc%d.odt - LibreOffice", i);
+    break;
+  case 3:
+    fprintf(f, "[regex %d] ^Tool%d: [^[:space:]]*$\n", i, i);
+    sprintf(title, "Tool%d: canvas", i);
+    break;
+  case 4:
+    fprintf(f, "[class %d] class=app%d\n", i, i);
+    sprintf(title, "app%d", i);
+    break;
+  }
+  fprintf(f, " K1 XK_KP_0\n K2 XK_Control_L/D \"z\"\n JL XK_Left\n JR XK_Right\n");
+}
+
+// write the config, and fill the corpus with titles selecting sections
+// spread through the file, plus the realistic titles
+void
+generate(char *file_name, int n)
+{
+  FILE *f = fopen(file_name, "w");
+  int targets = NUM_CORPUS / 2;
+  int target;
+  int i, t;
+  char title[64];
+
+  if (f == NULL) {
+    perror(file_name);
+    exit(1);
+  }
+  corpus_size = 0;
+  for (i=0; i<n; i++) {
+    make_section(f, i, title);
+    target = (long)i * targets / n;
+    if ((long)target * n / targets == i && corpus_size < targets) {
+      t = corpus_size++;
+      memset(&corpus[t], 0, sizeof(corpus[t]));
+      if (i % 5 == 4) {
+	strcpy(corpus_buf[t][1], title);
+	corpus[t].class = corpus_buf[t][1];
+	sprintf(corpus_buf[t][0], "Some %s window", title);
+      } else {
+	strcpy(corpus_buf[t][0], title);
+      }
+      corpus[t].title = corpus_buf[t][0];
+    }
+  }
+  fprintf(f, "[Default]\n JL XK_Scroll_Up\n JR XK_Scroll_Down\n");
+  fclose(f);
+  for (i=0; realistic_titles[i] != NULL && corpus_size < NUM_CORPUS; i++) {
+    memset(&corpus[corpus_size], 0, sizeof(corpus[0]));
+    corpus[corpus_size++].title = realistic_titles[i];
+  }
+}
+
+void
+lookup(window_info *info)
+{
+  if (get_window_translation(info) == NULL) {
+    fprintf(stderr, "no translation for %s\n", info->title);
+    exit(1);
+  }
+}
+
+// the cached case is timed over groups of this many titles, which fit
+// in the title cache, as when focus bounces between a few windows
+#define WORKING_SET 8
+
+// returns the average ns per lookup.  For the cached case, each group
+// of titles is looked up once before the timing starts, so only cache
+// hits are timed.
+double
+time_lookups(int cached)
+{
+  double start;
+  double elapsed = 0;
+  long count = 0;
+  int group, end;
+  int i;
+
+  if (!cached) {
+    start = now();
+    do {
+      for (i=0; i<corpus_size; i++) {
+	clear_title_cache();
+	lookup(&corpus[i]);
+      }
+      count += corpus_size;
+      elapsed = now() - start;
+    } while (elapsed < LOOKUP_SECONDS);
+    return elapsed * 1e9 / count;
+  }
+
+  for (group=0; group<corpus_size; group+=WORKING_SET) {
+    end = group + WORKING_SET < corpus_size ? group + WORKING_SET : corpus_size;
+    clear_title_cache();
+    for (i=group; i<end; i++) {
+      lookup(&corpus[i]);
+    }
+    start = now();
+    do {
+      for (i=group; i<end; i++) {
+	lookup(&corpus[i]);
+      }
+      count += end - group;
+    } while (now() - start < LOOKUP_SECONDS / ((corpus_size + WORKING_SET - 1) / WORKING_SET));
+    elapsed += now() - start;
+  }
+  return elapsed * 1e9 / count;
+}
+
+void
+measure(int n)
+{
+  char file_name[64] = "/tmp/shuttlebench.XXXXXX";
+  double start, parse;
+  long rss_before, rss_after;
+  int fd;
+
+  fd = mkstemp(file_name);
+  if (fd < 0) {
+    perror(file_name);
+    exit(1);
+  }
+  close(fd);
+  generate(file_name, n);
+  setenv("SHUTTLE_CONFIG_FILE", file_name, 1);
+
+  rss_before = resident_kb();
+  start = now();
+  read_config_file();
+  parse = now() - start;
+  rss_after = resident_kb();
+
+  printf("%8d %12.3f %10ld %14.0f %14.0f\n", n, parse * 1e3,
+	 rss_after - rss_before, time_lookups(0), time_lookups(1));
+  unlink(file_name);
+  strcat(file_name, ".cache");
+  unlink(file_name);
+}
+
+// write n sections split across files files in dir_name/frags, and a
+// main file including them
+void
+generate_split(char *dir_name, int n, int files)
+{
+  char file_name[128];
+  char title[64];
+  FILE *f;
+  int i;
+  int file;
+
+  sprintf(file_name, "%s/frags", dir_name);
+  if (mkdir(file_name, 0700) < 0) {
+    perror(file_name);
+    exit(1);
+  }
+  for (file=0; file<files; file++) {
+    sprintf(file_name, "%s/frags/%05d.rc", dir_name, file);
+    f = fopen(file_name, "w");
+    if (f == NULL) {
+      perror(file_name);
+      exit(1);
+    }
+    for (i = (long)file * n / files; i < (long)(file + 1) * n / files; i++) {
+      make_section(f, i, title);
+    }
+    fclose(f);
+  }
+  sprintf(file_name, "%s/main.rc", dir_name);
+  f = fopen(file_name, "w");
+  if (f == NULL) {
+    perror(file_name);
+    exit(1);
+  }
+  fprintf(f, "include_dir frags\n[Default]\n JL XK_Scroll_Up\n JR XK_Scroll_Down\n");
+  fclose(f);
+}
+
+void
+remove_split(char *dir_name, int files)
+{
+  char file_name[128];
+  int file;
+
+  for (file=0; file<files; file++) {
+    sprintf(file_name, "%s/frags/%05d.rc", dir_name, file);
+    unlink(file_name);
+  }
+  sprintf(file_name, "%s/frags", dir_name);
+  rmdir(file_name);
+  sprintf(file_name, "%s/main.rc", dir_name);
+  unlink(file_name);
+  rmdir(dir_name);
+}
+
+// ms to load the split config in a fresh child process, with the given
+// number of parse threads
+double
+time_split_load(char *dir_name, int threads)
+{
+  char file_name[128];
+  double ms = -1;
+  int fds[2];
+  int status;
+  pid_t pid;
+  double start;
+
+  if (pipe(fds) < 0) {
+    perror("pipe");
+    exit(1);
+  }
+  pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    sprintf(file_name, "%s/main.rc", dir_name);
+    setenv("SHUTTLE_CONFIG_FILE", file_name, 1);
+    parse_threads = threads;
+    start = now();
+    read_config_file();
+    ms = (now() - start) * 1e3;
+    if (write(fds[1], &ms, sizeof(ms)) != sizeof(ms)) {
+      exit(1);
+    }
+    exit(0);
+  }
+  close(fds[1]);
+  if (pid < 0 || read(fds[0], &ms, sizeof(ms)) != sizeof(ms) ||
+      waitpid(pid, &status, 0) < 0 || status != 0) {
+    fprintf(stderr, "split benchmark failed\n");
+    exit(1);
+  }
+  close(fds[0]);
+  return ms;
+}
+
+void
+measure_split(int n, int files)
+{
+  char dir_name[64] = "/tmp/shuttlebench.XXXXXX";
+  double serial, parallel;
+
+  if (mkdtemp(dir_name) == NULL) {
+    perror(dir_name);
+    exit(1);
+  }
+  generate_split(dir_name, n, files);
+  serial = time_split_load(dir_name, 1);
+  parallel = time_split_load(dir_name, 0);
+  printf("%8d %6d %12.3f %12.3f %8.2fx\n", n, files, serial, parallel,
+	 serial / parallel);
+  fflush(stdout);
+  remove_split(dir_name, files);
+}
+
+void
+usage(void)
+{
+  fprintf(stderr, "usage: shuttlebench N...\n"
+	  "       shuttlebench -f FILES N...\n");
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  int i;
+  int n;
+  int files = 0;
+  int status;
+  pid_t pid;
+
+  i = 1;
+  if (argc > 2 && !strcmp(argv[1], "-f")) {
+    files = atoi(argv[2]);
+    if (files <= 0) {
+      usage();
+    }
+    i = 3;
+  }
+  if (i >= argc) {
+    usage();
+  }
+  if (files > 0) {
+    printf("%8s %6s %12s %12s %9s\n", "sections", "files", "1 thread ms",
+	   "parallel ms", "speedup");
+    printf("(parallel uses up to %d threads)\n", max_parse_threads());
+  } else {
+    printf("%8s %12s %10s %14s %14s\n", "sections", "parse ms", "rss KiB",
+	   "uncached ns", "cached ns");
+  }
+  fflush(stdout);
+  for (; i<argc; i++) {
+    n = atoi(argv[i]);
+    if (n <= 0) {
+      fprintf(stderr, "bad section count: %s\n", argv[i]);
+      exit(1);
+    }
+    if (files > 0) {
+      measure_split(n, files);
+      continue;
+    }
+    pid = fork();
+    if (pid == 0) {
+      measure(n);
+      exit(0);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || status != 0) {
+      fprintf(stderr, "benchmark for %d sections failed\n", n);
+      exit(1);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,777 @@
+/*
+
+ End to end injection latency benchmark
+
+ Copyright 2013 Eric Messick (FixedImagePhoto.com/Contact)
+
+ Measures the whole pipeline, from a device event to the key event it
+ produces arriving at the X server.
+
+ usage: shuttlelatency [-d DISPLAY] [-n COUNT] [-b BURST] [-m MACROS] [-s SCROLLS] [SHUTTLEPRO]
+
+ A private Xvfb is started on DISPLAY (default :99), with one window
+ whose title matches the only section of a generated config, and the
+ keyboard focus on it.  A virtual ShuttlePRO is made through
+ /dev/uinput, and SHUTTLEPRO (default ./shuttlepro) is started on it.
+ The key events reaching the server are watched from a second
+ connection through the RECORD extension.
+
+ Each jog detent is bound to one key.  For the latency, COUNT detents
+ (default 1000) are sent one at a time, each waiting for its key press
+ to be recorded, and the distribution of the times from writing the
+ event to receiving the recorded press is printed.  For the
+ throughput, BURST detents (default 10000) are written as fast as
+ possible, and the time until the last of their presses is recorded
+ gives the rate.  NO_COALESCE is set, so every detent is sent.
+
+ The times include the RECORD extension passing the event back to us,
+ so they are an upper bound on what a client of the server would see.
+
+ The shuttle position SCROLL_POSITION is bound to scroll=SCROLL_RATE,
+ which the daemon sends through its own uinput wheel device.  Xvfb
+ doesn't read input devices, so that wheel's events are read straight
+ from its event node instead.  The shuttle is turned there and back
+ SCROLLS times (default 100), timing each from writing the shuttle
+ event to reading the first hi-res wheel event, and then held there
+ for SCROLL_SECONDS, to give the rate the wheel really turns at and the
+ longest gap between its events.
+
+ Then, to compare the daemon timing delay= itself with the X server
+ doing it under XTEST_DELAYS, each detent is bound to MACRO_KEYS keys
+ with delay=MACRO_DELAY_MS between them, and MACROS of them (default
+ 50) are played one at a time.  The error of each recorded gap between
+ presses from the delay asked for is printed, along with the daemon's
+ CPU time per macro, from /proc/PID/schedstat.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xproto.h>
+#include <X11/extensions/record.h>
+
+#define DEVICE_NAME "Contour Design ShuttlePRO v2"
+#define TARGET_TITLE "shuttlepro latency target"
+
+// how long to wait for the daemon to come up, and for each key press
+#define READY_SECONDS 10
+#define PRESS_TIMEOUT_MS 2000
+
+// the timed macro
+#define MACRO_KEYS 10
+#define MACRO_DELAY_MS 10
+
+// the scrolling shuttle position, and the wheel the daemon makes for it
+#define SCROLL_POSITION 3
+#define SCROLL_RATE 20
+#define SCROLL_SECONDS 2
+#define WHEEL_DEVICE_NAME "ShuttlePRO smooth scroll"
+#define WHEEL_HI_RES_UNITS 120
+#define WHEEL_QUIET_MS 50
+
+#ifndef REL_WHEEL_HI_RES
+#define REL_WHEEL_HI_RES 0x0b
+#endif
+
+static char *display_name = ":99";
+static pid_t xvfb_pid = 0;
+static pid_t daemon_pid = 0;
+static int device_fd = -1;
+static int jog_value = 10;
+static int wheel_fd = -1; // the daemon's wheel
+
+static Display *display; // owns the target window
+static Display *record_display; // data connection for RECORD
+static XRecordContext record_context;
+static long presses = 0; // key presses recorded so far
+static double last_press; // when the latest one was seen
+static double press_times[MACRO_KEYS]; // of the presses of one macro
+static long macro_base = -1; // presses before it, -1 when not timing one
+
+double
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void
+stop_children(void)
+{
+  if (daemon_pid > 0) {
+    kill(daemon_pid, SIGTERM);
+    waitpid(daemon_pid, NULL, 0);
+    daemon_pid = 0;
+  }
+  if (xvfb_pid > 0) {
+    kill(xvfb_pid, SIGTERM);
+    waitpid(xvfb_pid, NULL, 0);
+    xvfb_pid = 0;
+  }
+}
+
+void
+fail(char *what)
+{
+  if (errno != 0) {
+    perror(what);
+  } else {
+    fprintf(stderr, "%s\n", what);
+  }
+  stop_children();
+  exit(1);
+}
+
+void
+start_xvfb(void)
+{
+  double start = now();
+
+  xvfb_pid = fork();
+  if (xvfb_pid == 0) {
+    execlp("Xvfb", "Xvfb", display_name, "-nolisten", "tcp", "-screen", "0",
+	   "640x480x24", (char *)NULL);
+    perror("Xvfb");
+    exit(1);
+  }
+  if (xvfb_pid < 0) {
+    fail("fork");
+  }
+  while ((display = XOpenDisplay(display_name)) == NULL) {
+    if (now() - start > READY_SECONDS || waitpid(xvfb_pid, NULL, WNOHANG) != 0) {
+      errno = 0;
+      fail("Xvfb didn't start");
+    }
+    usleep(50000);
+  }
+}
+
+void
+create_target_window(void)
+{
+  Window win;
+
+  win = XCreateSimpleWindow(display, DefaultRootWindow(display), 0, 0, 200, 100,
+			    0, 0, 0);
+  XStoreName(display, win, TARGET_TITLE);
+  XMapWindow(display, win);
+  XSync(display, False);
+  XSetInputFocus(display, win, RevertToParent, CurrentTime);
+  XSync(display, False);
+}
+
+void
+record_callback(XPointer closure, XRecordInterceptData *data)
+{
+  (void)closure;
+  if (data->category == XRecordFromServer && data->data != NULL &&
+      (data->data[0] & 0x7f) == KeyPress) {
+    last_press = now();
+    if (macro_base >= 0 && presses - macro_base < MACRO_KEYS) {
+      press_times[presses - macro_base] = last_press;
+    }
+    presses++;
+  }
+  XRecordFreeData(data);
+}
+
+void
+start_recording(void)
+{
+  XRecordClientSpec clients = XRecordAllClients;
+  XRecordRange *range;
+  int major, minor;
+
+  record_display = XOpenDisplay(display_name);
+  if (record_display == NULL ||
+      !XRecordQueryVersion(record_display, &major, &minor)) {
+    errno = 0;
+    fail("no RECORD extension");
+  }
+  range = XRecordAllocRange();
+  range->device_events.first = KeyPress;
+  range->device_events.last = KeyPress;
+  record_context = XRecordCreateContext(display, 0, &clients, 1, &range, 1);
+  XFree(range);
+  XSync(display, False);
+  if (!XRecordEnableContextAsync(record_display, record_context,
+				 record_callback, NULL)) {
+    errno = 0;
+    fail("can't enable RECORD context");
+  }
+}
+
+// wait until at least count presses have been recorded.  returns 0 on
+// timeout.
+int
+wait_for_presses(long count, int timeout_ms)
+{
+  struct pollfd pfd;
+  double give_up = now() + timeout_ms / 1e3;
+
+  pfd.fd = ConnectionNumber(record_display);
+  pfd.events = POLLIN;
+  XRecordProcessReplies(record_display);
+  while (presses < count) {
+    if (now() > give_up) {
+      return 0;
+    }
+    poll(&pfd, 1, 10);
+    XRecordProcessReplies(record_display);
+  }
+  return 1;
+}
+
+void
+emit(int type, int code, int value)
+{
+  struct input_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.type = type;
+  ev.code = code;
+  ev.value = value;
+  if (write(device_fd, &ev, sizeof(ev)) != sizeof(ev)) {
+    fail("uinput write");
+  }
+}
+
+// one detent, alternating direction so the jog value never wraps
+void
+send_detent(void)
+{
+  jog_value = jog_value == 10 ? 11 : 10;
+  emit(EV_REL, REL_DIAL, jog_value);
+  emit(EV_SYN, SYN_REPORT, 0);
+}
+
+// move the shuttle.  The input layer drops a 0, so the shuttle is
+// brought back by send_detent() instead, the way the real device does.
+void
+send_shuttle(int value)
+{
+  emit(EV_REL, REL_WHEEL, value);
+  emit(EV_SYN, SYN_REPORT, 0);
+}
+
+// make the virtual device, and return the name of its event node
+char *
+create_device(void)
+{
+  static char node[PATH_MAX];
+  struct uinput_setup setup;
+  char sysname[32];
+  char dir_name[96];
+  struct dirent *d;
+  DIR *dir;
+
+  device_fd = open("/dev/uinput", O_WRONLY);
+  if (device_fd < 0) {
+    fail("/dev/uinput");
+  }
+  memset(&setup, 0, sizeof(setup));
+  setup.id.bustype = BUS_USB;
+  setup.id.vendor = 0x0b33;
+  setup.id.product = 0x0030;
+  strcpy(setup.name, DEVICE_NAME);
+  if (ioctl(device_fd, UI_SET_EVBIT, EV_REL) < 0 ||
+      ioctl(device_fd, UI_SET_RELBIT, REL_DIAL) < 0 ||
+      ioctl(device_fd, UI_SET_RELBIT, REL_WHEEL) < 0 ||
+      ioctl(device_fd, UI_DEV_SETUP, &setup) < 0 ||
+      ioctl(device_fd, UI_DEV_CREATE) < 0 ||
+      ioctl(device_fd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0) {
+    fail("uinput create");
+  }
+  snprintf(dir_name, sizeof(dir_name), "/sys/devices/virtual/input/%s", sysname);
+  node[0] = '\0';
+  // udev may take a moment to make the node
+  usleep(200000);
+  dir = opendir(dir_name);
+  if (dir == NULL) {
+    fail(dir_name);
+  }
+  while ((d = readdir(dir)) != NULL) {
+    if (!strncmp(d->d_name, "event", 5)) {
+      snprintf(node, sizeof(node), "/dev/input/%s", d->d_name);
+    }
+  }
+  closedir(dir);
+  if (node[0] == '\0') {
+    errno = 0;
+    fail("no event node for the virtual device");
+  }
+  return node;
+}
+
+// with macro set, each detent plays the timed macro instead of one key
+void
+write_config(char *file_name, int xtest_delays, int macro)
+{
+  FILE *f = fopen(file_name, "w");
+  char keys[MACRO_KEYS * 24] = "\"a\"";
+  int len = strlen(keys);
+  int i;
+
+  if (f == NULL) {
+    fail(file_name);
+  }
+  for (i=1; macro && i<MACRO_KEYS; i++) {
+    len += snprintf(keys + len, sizeof(keys) - len, " delay=%dms \"a\"",
+		    MACRO_DELAY_MS);
+  }
+  fprintf(f, "NO_COALESCE\n%s"
+	  "[Target] ^" TARGET_TITLE "$\n JL %s\n JR %s\n S%d scroll=%d\n",
+	  xtest_delays ? "XTEST_DELAYS\n" : "", keys, keys,
+	  SCROLL_POSITION, SCROLL_RATE);
+  fclose(f);
+}
+
+void
+start_daemon(char *shuttlepro, char *node, char *config)
+{
+  daemon_pid = fork();
+  if (daemon_pid == 0) {
+    setenv("DISPLAY", display_name, 1);
+    setenv("SHUTTLE_CONFIG_FILE", config, 1);
+    execl(shuttlepro, shuttlepro, node, (char *)NULL);
+    perror(shuttlepro);
+    exit(1);
+  }
+  if (daemon_pid < 0) {
+    fail("fork");
+  }
+}
+
+void
+stop_daemon(void)
+{
+  kill(daemon_pid, SIGTERM);
+  waitpid(daemon_pid, NULL, 0);
+  daemon_pid = 0;
+}
+
+// send detents until the daemon answers one, then wait for it to go
+// quiet
+void
+wait_for_daemon(void)
+{
+  long base = presses;
+  int i;
+
+  for (i=0; i<READY_SECONDS * 10; i++) {
+    send_detent();
+    if (wait_for_presses(base + 1, 100)) {
+      break;
+    }
+  }
+  if (presses == base) {
+    errno = 0;
+    fail("shuttlepro didn't respond");
+  }
+  // let any retries drain
+  while (wait_for_presses(presses + 1, 200)) {
+  }
+}
+
+// ns of CPU the daemon has used, or -1 if that can't be read
+long long
+daemon_cpu_ns(void)
+{
+  char name[64];
+  long long ns = -1;
+  FILE *f;
+
+  snprintf(name, sizeof(name), "/proc/%d/schedstat", (int)daemon_pid);
+  f = fopen(name, "r");
+  if (f != NULL) {
+    if (fscanf(f, "%lld", &ns) != 1) {
+      ns = -1;
+    }
+    fclose(f);
+  }
+  return ns;
+}
+
+int
+compare_doubles(const void *a, const void *b)
+{
+  double x = *(double *)a;
+  double y = *(double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+void
+measure(char *label, int count, int burst)
+{
+  double *latency = (double *)malloc(count * sizeof(double));
+  double total = 0;
+  double sent, start;
+  long base;
+  int lost = 0;
+  int i;
+
+  if (latency == NULL) {
+    fail("malloc");
+  }
+  wait_for_daemon();
+  for (i=0; i<count; i++) {
+    base = presses;
+    sent = now();
+    send_detent();
+    if (!wait_for_presses(base + 1, PRESS_TIMEOUT_MS)) {
+      lost++;
+      latency[i] = PRESS_TIMEOUT_MS / 1e3;
+      continue;
+    }
+    latency[i] = last_press - sent;
+    total += latency[i];
+  }
+  qsort(latency, count, sizeof(double), compare_doubles);
+  printf("%-14s %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %6d", label,
+	 latency[0] * 1e6, latency[count / 2] * 1e6, latency[count * 9 / 10] * 1e6,
+	 latency[count * 99 / 100] * 1e6, latency[count - 1] * 1e6,
+	 count > lost ? total / (count - lost) * 1e6 : 0.0, lost);
+
+  base = presses;
+  start = now();
+  for (i=0; i<burst; i++) {
+    send_detent();
+  }
+  if (wait_for_presses(base + burst, PRESS_TIMEOUT_MS + burst)) {
+    printf(" %12.0f\n", burst / (last_press - start));
+  } else {
+    printf(" %12s\n", "lost events");
+  }
+  fflush(stdout);
+  free(latency);
+}
+
+void
+measure_macros(char *label, int macros)
+{
+  double *error = (double *)malloc(macros * (MACRO_KEYS - 1) * sizeof(double));
+  double total = 0;
+  long long cpu_start, cpu_end;
+  int lost = 0;
+  int n = 0;
+  int i, j;
+
+  if (error == NULL) {
+    fail("malloc");
+  }
+  wait_for_daemon();
+  cpu_start = daemon_cpu_ns();
+  for (i=0; i<macros; i++) {
+    macro_base = presses;
+    send_detent();
+    if (!wait_for_presses(macro_base + MACRO_KEYS,
+			  PRESS_TIMEOUT_MS + MACRO_KEYS * MACRO_DELAY_MS)) {
+      lost++;
+      continue;
+    }
+    for (j=1; j<MACRO_KEYS; j++) {
+      error[n] = (press_times[j] - press_times[j-1]) - MACRO_DELAY_MS / 1e3;
+      total += error[n];
+      error[n] = error[n] < 0 ? -error[n] : error[n];
+      n++;
+    }
+  }
+  cpu_end = daemon_cpu_ns();
+  macro_base = -1;
+  if (n == 0) {
+    printf("%-14s %s\n", label, "lost every macro");
+    free(error);
+    return;
+  }
+  qsort(error, n, sizeof(double), compare_doubles);
+  printf("%-14s %8.1f %8.1f %8.1f %8.1f %6d", label, total / n * 1e6,
+	 error[n / 2] * 1e6, error[n * 99 / 100] * 1e6, error[n - 1] * 1e6, lost);
+  if (cpu_start >= 0 && cpu_end >= 0) {
+    printf(" %12.1f\n", (cpu_end - cpu_start) / 1e3 / macros);
+  } else {
+    printf(" %12s\n", "n/a");
+  }
+  fflush(stdout);
+  free(error);
+}
+
+// open the wheel device the daemon makes for scroll=.  returns 0 if it
+// doesn't show up.
+int
+open_wheel(void)
+{
+  char file_name[PATH_MAX];
+  char name[256];
+  struct dirent *d;
+  double start = now();
+  DIR *dir;
+  FILE *f;
+
+  while (now() - start < READY_SECONDS) {
+    dir = opendir("/sys/class/input");
+    if (dir == NULL) {
+      fail("/sys/class/input");
+    }
+    while ((d = readdir(dir)) != NULL) {
+      if (strncmp(d->d_name, "event", 5)) {
+	continue;
+      }
+      snprintf(file_name, sizeof(file_name), "/sys/class/input/%s/device/name",
+	       d->d_name);
+      f = fopen(file_name, "r");
+      if (f == NULL) {
+	continue;
+      }
+      if (fgets(name, sizeof(name), f) != NULL) {
+	name[strcspn(name, "\n")] = '\0';
+	if (!strcmp(name, WHEEL_DEVICE_NAME)) {
+	  snprintf(file_name, sizeof(file_name), "/dev/input/%s", d->d_name);
+	  // udev may not have made the node, or given us access, yet
+	  wheel_fd = open(file_name, O_RDONLY | O_NONBLOCK);
+	}
+      }
+      fclose(f);
+      if (wheel_fd >= 0) {
+	break;
+      }
+    }
+    closedir(dir);
+    if (wheel_fd >= 0) {
+      return 1;
+    }
+    usleep(50000);
+  }
+  return 0;
+}
+
+// read what the wheel has sent, waiting up to timeout_ms for it.
+// returns the hi-res units read, positive down, and sets *when to the
+// time they arrived.
+int
+read_wheel(int timeout_ms, double *when)
+{
+  struct input_event ev[64];
+  struct pollfd pfd;
+  int units = 0;
+  int n, i;
+
+  pfd.fd = wheel_fd;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, timeout_ms) <= 0) {
+    return 0;
+  }
+  *when = now();
+  while ((n = read(wheel_fd, ev, sizeof(ev))) > 0) {
+    for (i=0; i<n / (int)sizeof(ev[0]); i++) {
+      if (ev[i].type == EV_REL && ev[i].code == REL_WHEEL_HI_RES) {
+	units -= ev[i].value;
+      }
+    }
+  }
+  return units;
+}
+
+// bring the shuttle back to the center, and wait for the wheel to stop
+void
+stop_scroll(void)
+{
+  double when;
+
+  // the daemon only takes a detent as the shuttle's return to the
+  // center when it comes more than 5 ms after the shuttle moved
+  usleep(10000);
+  send_detent();
+  while (read_wheel(WHEEL_QUIET_MS, &when) != 0) {
+  }
+}
+
+void
+measure_scroll(char *label, int scrolls)
+{
+  double *latency = (double *)malloc(scrolls * sizeof(double));
+  double total = 0;
+  double sent, when, last;
+  double first = 0;
+  double gap = 0;
+  int units, got;
+  int lost = 0;
+  int i;
+
+  if (latency == NULL) {
+    fail("malloc");
+  }
+  wait_for_daemon();
+  // the first scroll makes the wheel
+  send_shuttle(SCROLL_POSITION);
+  if (!open_wheel()) {
+    send_detent();
+    printf("%-14s %s\n", label, "no wheel device");
+    free(latency);
+    return;
+  }
+  stop_scroll();
+
+  for (i=0; i<scrolls; i++) {
+    sent = now();
+    send_shuttle(SCROLL_POSITION);
+    if (read_wheel(PRESS_TIMEOUT_MS, &when) == 0) {
+      lost++;
+      latency[i] = PRESS_TIMEOUT_MS / 1e3;
+    } else {
+      latency[i] = when - sent;
+      total += latency[i];
+    }
+    stop_scroll();
+  }
+  qsort(latency, scrolls, sizeof(double), compare_doubles);
+  printf("%-14s %8.1f %8.1f %8.1f %8.1f %8.1f %6d", label,
+	 latency[0] * 1e6, latency[scrolls / 2] * 1e6,
+	 latency[scrolls * 99 / 100] * 1e6, latency[scrolls - 1] * 1e6,
+	 scrolls > lost ? total / (scrolls - lost) * 1e6 : 0.0, lost);
+
+  // the rate is taken from the first event on, so the wait for it
+  // doesn't count
+  send_shuttle(SCROLL_POSITION);
+  got = read_wheel(PRESS_TIMEOUT_MS, &first);
+  units = 0;
+  last = first;
+  while (got != 0 && last - first < SCROLL_SECONDS) {
+    got = read_wheel(PRESS_TIMEOUT_MS, &when);
+    if (got == 0) {
+      break;
+    }
+    units += got;
+    if (when - last > gap) {
+      gap = when - last;
+    }
+    last = when;
+  }
+  stop_scroll();
+  if (last > first) {
+    printf(" %10.2f %10.1f\n", units / (double)WHEEL_HI_RES_UNITS / (last - first),
+	   gap * 1e3);
+  } else {
+    printf(" %10s %10s\n", "n/a", "n/a");
+  }
+  fflush(stdout);
+  close(wheel_fd);
+  wheel_fd = -1;
+  free(latency);
+}
+
+void
+usage(void)
+{
+  fprintf(stderr, "usage: shuttlelatency [-d DISPLAY] [-n COUNT] [-b BURST] [-m MACROS]"
+	  " [-s SCROLLS] [SHUTTLEPRO]\n");
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  char config[64] = "/tmp/shuttlelatency.XXXXXX";
+  char *shuttlepro = "./shuttlepro";
+  char *node;
+  int count = 1000;
+  int burst = 10000;
+  int macros = 50;
+  int scrolls = 100;
+  int xtest_delays;
+  int opt;
+  int fd;
+
+  while ((opt = getopt(argc, argv, "d:n:b:m:s:")) != -1) {
+    switch (opt) {
+    case 'd':
+      display_name = optarg;
+      break;
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 'b':
+      burst = atoi(optarg);
+      break;
+    case 'm':
+      macros = atoi(optarg);
+      break;
+    case 's':
+      scrolls = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind < argc) {
+    shuttlepro = argv[optind++];
+  }
+  if (optind != argc || count <= 0 || burst <= 0 || macros <= 0 ||
+      scrolls <= 0) {
+    usage();
+  }
+  fd = mkstemp(config);
+  if (fd < 0) {
+    fail(config);
+  }
+  close(fd);
+
+  start_xvfb();
+  create_target_window();
+  start_recording();
+  node = create_device();
+
+  printf("latency in us from device event to recorded key press\n");
+  printf("%-14s %8s %8s %8s %8s %8s %8s %6s %12s\n", "output", "min", "median",
+	 "p90", "p99", "max", "mean", "lost", "burst ev/s");
+  write_config(config, 0, 0);
+  start_daemon(shuttlepro, node, config);
+  measure("XTest", count, burst);
+
+  printf("\nlatency in us from shuttle event to hi-res wheel event, for scroll=%d,"
+	 " and the rate it turns at\n", SCROLL_RATE);
+  printf("%-14s %8s %8s %8s %8s %8s %6s %10s %10s\n", "output", "min", "median",
+	 "p99", "max", "mean", "lost", "detents/s", "max gap ms");
+  measure_scroll("uinput wheel", scrolls);
+  stop_daemon();
+
+  printf("\nerror in us of the gaps in a macro of %d keys, %d ms apart,"
+	 " and daemon CPU per macro\n", MACRO_KEYS, MACRO_DELAY_MS);
+  printf("%-14s %8s %8s %8s %8s %6s %12s\n", "delays", "mean", "p50 |e|",
+	 "p99 |e|", "max |e|", "lost", "cpu us");
+  for (xtest_delays=0; xtest_delays<=1; xtest_delays++) {
+    write_config(config, xtest_delays, 1);
+    start_daemon(shuttlepro, node, config);
+    measure_macros(xtest_delays ? "XTEST_DELAYS" : "daemon timers", macros);
+    stop_daemon();
+  }
+
+  ioctl(device_fd, UI_DEV_DESTROY);
+  close(device_fd);
+  XRecordDisableContext(display, record_context);
+  XRecordFreeContext(display, record_context);
+  XCloseDisplay(display);
+  stop_children();
+  unlink(config);
+  strcat(config, ".cache");
+  unlink(config);
+  return 0;
+}
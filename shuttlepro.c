@@ -15,16 +15,62 @@
 
 #include "shuttle.h"
 
+#include <signal.h>
+
 typedef struct input_event EV;
 
 extern int debug_regex;
 extern translation *default_translation;
+extern Window replay_window;
+extern char *replay_title;
 
-unsigned short jogvalue = 0xffff;
+jog_decoder jog_state = { -1, 0, 0, 0 };
 int shuttlevalue = 0xffff;
 struct timeval last_shuttle;
 int need_synthetic_shuttle;
-Display *display;
+struct timeval event_time; // of the event being handled, on the now_ms() clock
+int event_expired; // it's a jog event past EVENT_DEADLINE
+int event_reports = 1; // jog events merged into it, itself included
+int focus_changed; // by the event being handled
+Display *display; // NULL for the null output sink used by --replay
+Atom net_wm_pid_atom;
+
+// --profile-startup: report how long each startup phase takes, up to
+// the point where we are ready to read the first event, then exit.
+int profile_startup = 0;
+struct timespec profile_start;
+struct timespec profile_last;
+
+double
+elapsed_ms(struct timespec *from, struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) * 1e3 +
+    (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+void
+profile_phase(char *phase)
+{
+  struct timespec now;
+
+  if (profile_startup) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("%-24s %10.3f ms\n", phase, elapsed_ms(&profile_last, &now));
+    profile_last = now;
+  }
+}
+
+void
+profile_ready(void)
+{
+  struct timespec now;
+
+  if (profile_startup) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("%-24s %10.3f ms\n", "time to ready", elapsed_ms(&profile_start, &now));
+    exit(0);
+  }
+}
 
 
 void
@@ -37,35 +83,80 @@ initdisplay(void)
     fprintf(stderr, "unable to open X display\n");
     exit(1);
   }
+  profile_phase("XOpenDisplay");
   if (!XTestQueryExtension(display, &event, &error, &major, &minor)) {
     fprintf(stderr, "Xtest extensions not supported\n");
     XCloseDisplay(display);
     exit(1);
   }
+  profile_phase("XTestQueryExtension");
+  net_wm_pid_atom = XInternAtom(display, "_NET_WM_PID", False);
 }
 
 void
-send_button(unsigned int button, int press)
+flush_output(void)
 {
-  XTestFakeButtonEvent(display, button, press ? True : False, DELAY);
+  if (display != NULL) {
+    XFlush(display);
+    stat_add(STAT_FLUSHES, 1);
+  }
+  trace_point(TRACE_FLUSH, 0, 0, 0, 0);
 }
 
 void
-send_key(KeySym key, int press)
+send_button(unsigned int button, int press, unsigned long delay)
+{
+  stat_add(STAT_STROKES, 1);
+  if (display != NULL) {
+    XTestFakeButtonEvent(display, button, press ? True : False, delay);
+    stat_add(STAT_XTEST_REQUESTS, 1);
+  }
+}
+
+void
+send_key_delayed(KeySym key, int press, unsigned long delay)
 {
   KeyCode keycode;
 
   if (key >= XK_Button_1 && key <= XK_Scroll_Down) {
-    send_button((unsigned int)key - XK_Button_0, press);
+    send_button((unsigned int)key - XK_Button_0, press, delay);
+    return;
+  }
+  stat_add(STAT_STROKES, 1);
+  if (display == NULL) {
     return;
   }
   keycode = XKeysymToKeycode(display, key);
-  XTestFakeKeyEvent(display, keycode, press ? True : False, DELAY);
+  XTestFakeKeyEvent(display, keycode, press ? True : False, delay);
+  stat_add(STAT_XTEST_REQUESTS, 1);
+}
+
+void
+send_key(KeySym key, int press)
+{
+  send_key_delayed(key, press, DELAY);
+}
+
+chord *
+fetch_chord(translation *tr, int index)
+{
+  chord *c;
+
+  if (tr != NULL) {
+    for (c = tr->chords; c != NULL; c = c->next) {
+      if (c->key1 * NUM_KEYS + c->key2 == index) {
+	return c;
+      }
+    }
+  }
+  return NULL;
 }
 
 stroke *
 fetch_stroke(translation *tr, int kjs, int index)
 {
+  chord *c;
+
   if (tr != NULL) {
     switch (kjs) {
     case KJS_SHUTTLE:
@@ -74,6 +165,21 @@ fetch_stroke(translation *tr, int kjs, int index)
       return tr->jog[index];
     case KJS_KEY_UP:
       return tr->key_up[index];
+    case KJS_HOLD_DOWN:
+      return tr->hold_down[index];
+    case KJS_HOLD_UP:
+      return tr->hold_up[index];
+    case KJS_DOUBLE_DOWN:
+      return tr->double_down[index];
+    case KJS_DOUBLE_UP:
+      return tr->double_up[index];
+    case KJS_CHORD_DOWN:
+    case KJS_CHORD_UP:
+      c = fetch_chord(tr, index);
+      if (c == NULL) {
+	return NULL;
+      }
+      return kjs == KJS_CHORD_DOWN ? c->down : c->up;
     case KJS_KEY_DOWN:
     default:
       return tr->key_down[index];
@@ -82,6 +188,175 @@ fetch_stroke(translation *tr, int kjs, int index)
   return NULL;
 }
 
+long long
+now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+long long
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Sequences containing delay= are sent up to the first delayed stroke,
+// and the rest is kept here until it is due.  The main loop sends due
+// strokes between reading events, so a slow macro never holds up the
+// handling of later events.
+#define MAX_TIMED_MACROS 16
+
+typedef struct _timed_macro {
+  stroke *next; // next stroke to send, NULL if this slot is unused
+  stroke *then; // sequence to start when this one is done
+  long long due; // when to send next, in now_ms() time
+  int kjs;
+  int index;
+} timed_macro;
+
+static timed_macro timed_macros[MAX_TIMED_MACROS];
+
+// send strokes until reaching one which has to wait, which is
+// returned.  If waited is set, the delay of the first stroke has
+// already passed.
+stroke *
+send_strokes(stroke *s, int waited)
+{
+  while (s != NULL) {
+    if (s->delay > 0 && !waited) {
+      return s;
+    }
+    waited = 0;
+    send_key(s->keysym, s->press);
+    s = s->next;
+  }
+  return NULL;
+}
+
+void
+send_all_strokes(stroke *s)
+{
+  while (s != NULL) {
+    send_key(s->keysym, s->press);
+    s = s->next;
+  }
+}
+
+void
+start_timed_macro(stroke *s, int kjs, int index)
+{
+  timed_macro *m;
+  int i;
+
+  // a key release waits for the rest of its press sequence
+  if (kjs == KJS_KEY_UP || kjs == KJS_HOLD_UP || kjs == KJS_DOUBLE_UP ||
+      kjs == KJS_CHORD_UP) {
+    for (i=0; i<MAX_TIMED_MACROS; i++) {
+      m = &timed_macros[i];
+      if (m->next != NULL && m->kjs == kjs - 1 && m->index == index &&
+	  m->then == NULL) {
+	m->then = s;
+	return;
+      }
+    }
+  }
+  s = send_strokes(s, 0);
+  if (s == NULL) {
+    return;
+  }
+  for (i=0; i<MAX_TIMED_MACROS; i++) {
+    m = &timed_macros[i];
+    if (m->next == NULL) {
+      m->next = s;
+      m->then = NULL;
+      m->due = now_ms() + s->delay;
+      m->kjs = kjs;
+      m->index = index;
+      return;
+    }
+  }
+  fprintf(stderr, "too many delayed sequences, sending without delay\n");
+  send_all_strokes(s);
+}
+
+// send whatever is due, returns the number of ms until the next stroke
+// is due, or -1 if nothing is waiting
+int
+run_timed_macros(void)
+{
+  long long now = now_ms();
+  long long next_due = -1;
+  timed_macro *m;
+  int sent = 0;
+  int i;
+
+  for (i=0; i<MAX_TIMED_MACROS; i++) {
+    m = &timed_macros[i];
+    while (m->next != NULL && m->due <= now) {
+      m->next = send_strokes(m->next, 1);
+      sent = 1;
+      if (m->next != NULL) {
+	m->due += m->next->delay;
+      } else if (m->then != NULL) {
+	m->next = send_strokes(m->then, 0);
+	m->then = NULL;
+	m->kjs++; // now playing the release
+	if (m->next != NULL) {
+	  m->due = now + m->next->delay;
+	}
+      }
+    }
+    if (m->next != NULL && (next_due < 0 || m->due < next_due)) {
+      next_due = m->due;
+    }
+  }
+  if (sent) {
+    flush_output();
+  }
+  return next_due < 0 ? -1 : (int)(next_due - now);
+}
+
+// send everything still waiting, without delays.  Used before the
+// config is reloaded, since the strokes are about to be freed.
+void
+finish_timed_macros(void)
+{
+  timed_macro *m;
+  int i;
+
+  for (i=0; i<MAX_TIMED_MACROS; i++) {
+    m = &timed_macros[i];
+    if (m->next != NULL) {
+      send_all_strokes(m->next);
+      send_all_strokes(m->then);
+      m->next = NULL;
+      m->then = NULL;
+    }
+  }
+  flush_output();
+}
+
+// With XTEST_DELAYS, the whole sequence goes out at once, with each
+// stroke's delay passed along in the XTest request.  The X server then
+// does the waiting, so the timing doesn't depend on this process being
+// scheduled.  The catch is that the server holds back all further
+// requests from this connection until the delays have passed, so
+// events arriving meanwhile are delayed too.
+void
+send_server_timed_strokes(stroke *s)
+{
+  while (s != NULL) {
+    send_key_delayed(s->keysym, s->press, s->delay > 0 ? s->delay : DELAY);
+    s = s->next;
+  }
+}
+
 void
 send_stroke_sequence(translation *tr, int kjs, int index)
 {
@@ -91,11 +366,275 @@ send_stroke_sequence(translation *tr, int kjs, int index)
   if (s == NULL) {
     s = fetch_stroke(default_translation, kjs, index);
   }
-  while (s) {
-    send_key(s->keysym, s->press);
-    s = s->next;
+  if (settings.xtest_delays) {
+    send_server_timed_strokes(s);
+  } else {
+    start_timed_macro(s, kjs, index);
+  }
+  flush_output();
+}
+
+// Key gestures.  A key with no :hold, :double or chord bindings in the
+// current translation or the default is sent straight through, so it
+// acts as soon as it is pressed.  Only keys which do have such
+// bindings wait to see which gesture is being made, and only as long
+// as their own bindings need: a chord key for CHORD_TIME, a :hold key
+// for HOLD_TIME, and a :double key until it is released and then
+// DOUBLE_TIME for the second press.
+#define DEFAULT_HOLD_TIME 500
+#define DEFAULT_DOUBLE_TIME 250
+#define DEFAULT_CHORD_TIME 50
+
+#define GS_IDLE 0
+#define GS_PRESSED 1 // waiting to see what the press turns into
+#define GS_RELEASED 2 // tapped once, waiting for a second press
+#define GS_TAP 3 // the ordinary press sequence was sent
+#define GS_HOLD 4
+#define GS_DOUBLE 5
+#define GS_CHORD 6
+#define GS_IGNORE 7 // nothing to send for the next release
+
+#define GESTURE_TAP 0
+#define GESTURE_HOLD 1
+#define GESTURE_DOUBLE 2
+#define GESTURE_CHORD 3
+#define NUM_GESTURES 4
+
+static char *gesture_names[NUM_GESTURES] = { "tap", "hold", "double", "chord" };
+
+typedef struct _key_gesture {
+  int state;
+  long long since; // when the press or release being decided on happened
+  translation *tr; // translation in effect when the gesture started
+  int partner; // the other key of a chord
+} key_gesture;
+
+static key_gesture gestures[NUM_KEYS];
+
+// how long each kind of gesture took to be recognized
+unsigned long gesture_count[NUM_GESTURES];
+long long gesture_latency_total[NUM_GESTURES]; // ms
+long long gesture_latency_max[NUM_GESTURES]; // ms
+
+int
+gesture_time(int setting, int default_time)
+{
+  return setting > 0 ? setting : default_time;
+}
+
+int
+has_gesture(translation *tr, int kjs_down, int kjs_up, int index)
+{
+  return fetch_stroke(tr, kjs_down, index) || fetch_stroke(tr, kjs_up, index) ||
+    fetch_stroke(default_translation, kjs_down, index) ||
+    fetch_stroke(default_translation, kjs_up, index);
+}
+
+int
+has_chord(translation *tr, int k1, int k2)
+{
+  int index = k1 < k2 ? k1 * NUM_KEYS + k2 : k2 * NUM_KEYS + k1;
+
+  return fetch_chord(tr, index) || fetch_chord(default_translation, index);
+}
+
+void
+record_gesture(int gesture, int k, long long since, long long now)
+{
+  long long latency = now - since;
+
+  gesture_count[gesture]++;
+  gesture_latency_total[gesture] += latency;
+  if (latency > gesture_latency_max[gesture]) {
+    gesture_latency_max[gesture] = latency;
+  }
+  if (settings.debug_gestures) {
+    printf("gesture: K%d %s decided after %lld ms (average %lld ms, max %lld ms)\n",
+	   k + 1, gesture_names[gesture], latency,
+	   gesture_latency_total[gesture] / (long long)gesture_count[gesture],
+	   gesture_latency_max[gesture]);
   }
-  XFlush(display);
+}
+
+void
+gesture_press(int k, translation *tr, long long now)
+{
+  key_gesture *g = &gestures[k];
+  key_gesture *other;
+  int j;
+
+  if (g->state == GS_RELEASED) {
+    record_gesture(GESTURE_DOUBLE, k, g->since, now);
+    g->state = GS_DOUBLE;
+    send_stroke_sequence(g->tr, KJS_DOUBLE_DOWN, k);
+    return;
+  }
+  for (j=0; j<NUM_KEYS; j++) {
+    other = &gestures[j];
+    if (j != k && other->state == GS_PRESSED &&
+	now - other->since < gesture_time(settings.chord_time, DEFAULT_CHORD_TIME) &&
+	has_chord(other->tr, j, k)) {
+      record_gesture(GESTURE_CHORD, j, other->since, now);
+      other->state = GS_CHORD;
+      other->partner = k;
+      g->state = GS_CHORD;
+      g->partner = j;
+      g->tr = other->tr;
+      send_stroke_sequence(g->tr, KJS_CHORD_DOWN,
+			   j < k ? j * NUM_KEYS + k : k * NUM_KEYS + j);
+      return;
+    }
+  }
+  if (!((tr->gesture_keys |
+	 (default_translation ? default_translation->gesture_keys : 0)) & (1 << k))) {
+    g->state = GS_IDLE;
+    send_stroke_sequence(tr, KJS_KEY_DOWN, k);
+    return;
+  }
+  g->state = GS_PRESSED;
+  g->since = now;
+  g->tr = tr;
+}
+
+void
+gesture_release(int k, translation *tr, long long now)
+{
+  key_gesture *g = &gestures[k];
+  int j;
+
+  switch (g->state) {
+  case GS_PRESSED:
+    if (has_gesture(g->tr, KJS_DOUBLE_DOWN, KJS_DOUBLE_UP, k)) {
+      g->state = GS_RELEASED;
+      g->since = now;
+      return;
+    }
+    record_gesture(GESTURE_TAP, k, g->since, now);
+    send_stroke_sequence(g->tr, KJS_KEY_DOWN, k);
+    send_stroke_sequence(g->tr, KJS_KEY_UP, k);
+    break;
+  case GS_TAP:
+    send_stroke_sequence(g->tr, KJS_KEY_UP, k);
+    break;
+  case GS_HOLD:
+    send_stroke_sequence(g->tr, KJS_HOLD_UP, k);
+    break;
+  case GS_DOUBLE:
+    send_stroke_sequence(g->tr, KJS_DOUBLE_UP, k);
+    break;
+  case GS_CHORD:
+    j = g->partner;
+    send_stroke_sequence(g->tr, KJS_CHORD_UP,
+			 j < k ? j * NUM_KEYS + k : k * NUM_KEYS + j);
+    if (gestures[j].state == GS_CHORD) {
+      gestures[j].state = GS_IGNORE;
+    }
+    break;
+  case GS_IGNORE:
+  case GS_RELEASED:
+    break;
+  case GS_IDLE:
+  default:
+    send_stroke_sequence(tr, KJS_KEY_UP, k);
+    break;
+  }
+  g->state = GS_IDLE;
+}
+
+// act on gestures whose time is up.  returns the number of ms until the
+// next one will be, or -1 if none are waiting.
+int
+run_gestures(void)
+{
+  long long now = now_ms();
+  long long next_due = -1;
+  long long due;
+  key_gesture *g;
+  int k;
+
+  for (k=0; k<NUM_KEYS; k++) {
+    g = &gestures[k];
+    due = -1;
+    if (g->state == GS_PRESSED) {
+      if (has_gesture(g->tr, KJS_HOLD_DOWN, KJS_HOLD_UP, k)) {
+	due = g->since + gesture_time(settings.hold_time, DEFAULT_HOLD_TIME);
+	if (now >= due) {
+	  record_gesture(GESTURE_HOLD, k, g->since, now);
+	  g->state = GS_HOLD;
+	  send_stroke_sequence(g->tr, KJS_HOLD_DOWN, k);
+	  continue;
+	}
+      } else if (!has_gesture(g->tr, KJS_DOUBLE_DOWN, KJS_DOUBLE_UP, k)) {
+	// only chords, and the other key didn't come
+	due = g->since + gesture_time(settings.chord_time, DEFAULT_CHORD_TIME);
+	if (now >= due) {
+	  record_gesture(GESTURE_TAP, k, g->since, now);
+	  g->state = GS_TAP;
+	  send_stroke_sequence(g->tr, KJS_KEY_DOWN, k);
+	  continue;
+	}
+      }
+    } else if (g->state == GS_RELEASED) {
+      due = g->since + gesture_time(settings.double_time, DEFAULT_DOUBLE_TIME);
+      if (now >= due) {
+	record_gesture(GESTURE_TAP, k, g->since, now);
+	g->state = GS_IDLE;
+	send_stroke_sequence(g->tr, KJS_KEY_DOWN, k);
+	send_stroke_sequence(g->tr, KJS_KEY_UP, k);
+	continue;
+      }
+    }
+    if (due >= 0 && (next_due < 0 || due < next_due)) {
+      next_due = due;
+    }
+  }
+  return next_due < 0 ? -1 : (int)(next_due - now);
+}
+
+// settle every gesture in progress, before the translations they point
+// to are freed for a config reload.  Undecided presses are taken as
+// taps, and keys still down are released.
+void
+finish_gestures(void)
+{
+  key_gesture *g;
+  int down;
+  int k;
+
+  for (k=0; k<NUM_KEYS; k++) {
+    g = &gestures[k];
+    down = g->state != GS_IDLE && g->state != GS_RELEASED;
+    switch (g->state) {
+    case GS_PRESSED:
+    case GS_RELEASED:
+      send_stroke_sequence(g->tr, KJS_KEY_DOWN, k);
+      send_stroke_sequence(g->tr, KJS_KEY_UP, k);
+      break;
+    case GS_TAP:
+    case GS_HOLD:
+    case GS_DOUBLE:
+    case GS_CHORD:
+      gesture_release(k, g->tr, now_ms());
+      break;
+    }
+    g->state = down ? GS_IGNORE : GS_IDLE;
+  }
+}
+
+void
+before_config_reload(void)
+{
+  finish_gestures();
+  finish_timed_macros();
+}
+
+// when the event being handled happened, in now_ms() time.  Events
+// can wait in the reader's ring while output catches up, so this is
+// what gesture and shuttle timing go by.
+long long
+event_ms(void)
+{
+  return event_time.tv_sec * 1000LL + event_time.tv_usec / 1000;
 }
 
 void
@@ -103,25 +642,116 @@ key(unsigned short code, unsigned int value, translation *tr)
 {
   code -= EVENT_CODE_KEY1;
 
-  if (code <= NUM_KEYS) {
-    send_stroke_sequence(tr, value ? KJS_KEY_DOWN : KJS_KEY_UP, code);
+  if (code < NUM_KEYS) {
+    if (value) {
+      gesture_press(code, tr, event_ms());
+    } else {
+      gesture_release(code, tr, event_ms());
+    }
   } else {
     fprintf(stderr, "key(%d, %d) out of range\n", code + EVENT_CODE_KEY1, value);
   }
 }
 
 
+// Continuous scrolling for shuttle positions bound with scroll=.  The
+// scroll position is advanced by velocity times the time gone by, and
+// only whole output steps are sent, keeping the fraction: detents of
+// 1/WHEEL_HI_RES_UNITS through the uinput wheel in wheel.c where it can
+// be made, otherwise whole detents as wheel clicks.  The main loop
+// sleeps until the next step is due, but sends hi-res steps no more
+// than SCROLL_FPS times a second, several at once when they come
+// faster.
+#define SCROLL_FPS 60
+
+static double scroll_velocity = 0; // detents per second, positive is down
+static double scroll_accumulated = 0;
+static long long scroll_last_tick;
+static int scroll_hires = 0; // scrolling through the uinput wheel
+
+void
+set_scroll_velocity(translation *tr, int index)
+{
+  int rate = 0;
+
+  if (tr != NULL) {
+    rate = tr->scroll_rate[index];
+    if (rate == 0 && tr->shuttle[index] == NULL && default_translation != NULL) {
+      rate = default_translation->scroll_rate[index];
+    }
+  }
+  if (rate != 0 && scroll_velocity == 0) {
+    scroll_last_tick = now_ms();
+    scroll_hires = display != NULL && open_hires_wheel();
+  }
+  if (rate == 0) {
+    scroll_accumulated = 0;
+    if (scroll_hires) {
+      reset_hires_wheel();
+    }
+  }
+  scroll_velocity = rate;
+}
+
+// returns the number of ms until the next step is due, or -1 when not
+// scrolling
+int
+run_smooth_scroll(void)
+{
+  long long now;
+  double step; // in detents
+  double left;
+  int units;
+  int button;
+  int wait;
+
+  if (scroll_velocity == 0) {
+    return -1;
+  }
+  now = now_ms();
+  scroll_accumulated += scroll_velocity * (now - scroll_last_tick) / 1000.0;
+  scroll_last_tick = now;
+  if (scroll_hires) {
+    step = 1.0 / WHEEL_HI_RES_UNITS;
+    units = (int)(scroll_accumulated * WHEEL_HI_RES_UNITS);
+    if (units != 0) {
+      send_hires_wheel(units);
+      scroll_accumulated -= (double)units / WHEEL_HI_RES_UNITS;
+    }
+  } else {
+    step = 1;
+    if (scroll_accumulated >= 1 || scroll_accumulated <= -1) {
+      while (scroll_accumulated >= 1 || scroll_accumulated <= -1) {
+	button = scroll_accumulated > 0 ? XK_Scroll_Down : XK_Scroll_Up;
+	send_key(button, 1);
+	send_key(button, 0);
+	scroll_accumulated += scroll_accumulated > 0 ? -1 : 1;
+      }
+      flush_output();
+    }
+  }
+  // until the fraction reaches the next whole step
+  left = step - (scroll_velocity > 0 ? scroll_accumulated : -scroll_accumulated);
+  wait = (int)(left / (scroll_velocity > 0 ? scroll_velocity : -scroll_velocity)
+	       * 1000) + 1;
+  if (scroll_hires && wait < 1000 / SCROLL_FPS) {
+    wait = 1000 / SCROLL_FPS;
+  }
+  return wait;
+}
+
 void
 shuttle(int value, translation *tr)
 {
   if (value < -7 || value > 7) {
     fprintf(stderr, "shuttle(%d) out of range\n", value);
   } else {
-    gettimeofday(&last_shuttle, 0);
+    last_shuttle = event_time;
     need_synthetic_shuttle = value != 0;
     if( value != shuttlevalue ) {
       shuttlevalue = value;
       send_stroke_sequence(tr, KJS_SHUTTLE, value+7);
+      set_scroll_velocity(tr, value+7);
     }
   }
 }
@@ -129,23 +759,29 @@ shuttle(int value, translation *tr)
 // Due to a bug (?) in the way Linux HID handles the ShuttlePro, the
 // center position is not reported for the shuttle wheel.  Instead,
 // a jog event is generated immediately when it returns.  We check to
-// see if the time since the last shuttle was more than a few ms ago
-// and generate a shuttle of 0 if so.
+// see if the last shuttle event was more than a few ms before this
+// one, and generate a shuttle of 0 if so.
+//
+// Note, this fails if the jog position happens to be 0, as we don't see
+// that event either!  The jog steps are still counted right, as
+// decode_jog() sees the jump past 0 when the wheel next moves.
 //
-// Note, this fails if jogvalue happens to be 0, as we don't see that
-// event either!
+// None of this applies to a hidraw device, which reports the shuttle
+// center and jog 0 like any other position.
+#define DEFAULT_JOG_MAX_STEPS 16
+
 void
 jog(unsigned int value, translation *tr)
 {
-  int direction;
-  struct timeval now;
+  int max_steps = settings.jog_max_steps > 0 ?
+    settings.jog_max_steps : DEFAULT_JOG_MAX_STEPS;
+  int steps;
   struct timeval delta;
 
   // We should generate a synthetic event for the shuttle going
   // to the home position if we have not seen one recently
-  if (need_synthetic_shuttle) {
-    gettimeofday( &now, 0 );
-    timersub( &now, &last_shuttle, &delta );
+  if (need_synthetic_shuttle && !hidraw_device) {
+    timersub( &event_time, &last_shuttle, &delta );
 
     if (delta.tv_sec >= 1 || delta.tv_usec >= 5000) {
       shuttle(0, tr);
@@ -153,18 +789,24 @@ jog(unsigned int value, translation *tr)
     }
   }
 
-  if (jogvalue != 0xffff) {
-    value = value & 0xff;
-    direction = ((value - jogvalue) & 0x80) ? -1 : 1;
-    while (jogvalue != value) {
-      // driver fails to send an event when jogvalue == 0
-      if (jogvalue != 0) {
-	send_stroke_sequence(tr, KJS_JOG, direction > 0 ? 1 : 0);
-      }
-      jogvalue = (jogvalue + direction) & 0xff;
-    }
+  steps = decode_jog(&jog_state, value,
+		     event_time.tv_sec * 1000000LL + event_time.tv_usec,
+		     event_reports, settings.jog_timed);
+  if (event_expired) {
+    stat_add(STAT_JOG_EXPIRED, 1);
+    return;
+  }
+  // a merged backlog mustn't turn into a long scrub
+  if (steps > max_steps || steps < -max_steps) {
+    stat_add(STAT_JOG_STEPS_CAPPED, (steps > 0 ? steps : -steps) - max_steps);
+    steps = steps > 0 ? max_steps : -max_steps;
+  }
+  for (; steps > 0; steps--) {
+    send_stroke_sequence(tr, KJS_JOG, 1);
+  }
+  for (; steps < 0; steps++) {
+    send_stroke_sequence(tr, KJS_JOG, 0);
   }
-  jogvalue = value;
 }
 
 void
@@ -186,13 +828,12 @@ jogshuttle(unsigned short code, unsigned int value, translation *tr)
 char *
 get_window_name(Window win)
 {
-  Atom prop = XInternAtom(display, "WM_NAME", False);
   Atom type;
   int form;
   unsigned long remain, len;
   unsigned char *list;
 
-  if (XGetWindowProperty(display, win, prop, 0, 1024, False,
+  if (XGetWindowProperty(display, win, XA_WM_NAME, 0, 1024, False,
 			 AnyPropertyType, &type, &form, &len, &remain,
 			 &list) != Success) {
     fprintf(stderr, "XGetWindowProperty failed for window 0x%x\n", (int)win);
@@ -202,8 +843,10 @@ get_window_name(Window win)
   return (char*)list;
 }
 
+// returns the name of the first window with a WM_NAME property found
+// walking up from win, storing that window in *named_win.
 char *
-walk_window_tree(Window win)
+walk_window_tree(Window win, Window *named_win)
 {
   char *window_name;
   Window root = 0;
@@ -214,6 +857,7 @@ walk_window_tree(Window win)
   while (win != root) {
     window_name = get_window_name(win);
     if (window_name != NULL) {
+      *named_win = win;
       return window_name;
     }
     if (XQueryTree(display, win, &root, &parent, &children, &nchildren)) {
@@ -227,33 +871,202 @@ walk_window_tree(Window win)
   return NULL;
 }
 
+// returns 1 if win has a WM_CLASS or _NET_WM_PID property
+int
+has_application_property(Window win)
+{
+  Atom type;
+  int form;
+  unsigned long remain, len;
+  unsigned char *list = NULL;
+  XClassHint class_hint;
+
+  if (XGetClassHint(display, win, &class_hint)) {
+    if (class_hint.res_name != NULL) {
+      XFree(class_hint.res_name);
+    }
+    if (class_hint.res_class != NULL) {
+      XFree(class_hint.res_class);
+    }
+    return 1;
+  }
+  if (XGetWindowProperty(display, win, net_wm_pid_atom, 0, 0, False,
+			 AnyPropertyType, &type, &form, &len, &remain,
+			 &list) != Success) {
+    return 0;
+  }
+  if (list != NULL) {
+    XFree(list);
+  }
+  return type != None;
+}
+
+// for a focused window with no WM_NAME above it, returns the first
+// window found walking up from win which says what application it
+// belongs to, or 0 if there isn't one
+Window
+walk_to_application_window(Window win)
+{
+  Window root = 0;
+  Window parent;
+  Window *children;
+  unsigned int nchildren;
+
+  while (win != root && win != None && win != PointerRoot) {
+    if (has_application_property(win)) {
+      return win;
+    }
+    if (!XQueryTree(display, win, &root, &parent, &children, &nchildren)) {
+      return 0;
+    }
+    win = parent;
+    if (children != NULL) {
+      XFree(children);
+    }
+  }
+  return 0;
+}
+
+// read the first line of a file into buf, without the newline
+int
+read_proc_string(char *path, char *buf, size_t size)
+{
+  int fd;
+  ssize_t len;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  len = read(fd, buf, size-1);
+  close(fd);
+  if (len <= 0) {
+    return 0;
+  }
+  buf[len] = '\0';
+  buf[strcspn(buf, "\n")] = '\0';
+  return 1;
+}
+
+// fill in the comm and exe names of the process owning the window, as
+// given by its _NET_WM_PID property.  comm and exe must have room for
+// PATH_MAX characters.
+void
+get_window_process(Window win, window_info *info, char *comm, char *exe)
+{
+  Atom type;
+  int form;
+  unsigned long remain, len;
+  unsigned char *list;
+  unsigned long pid;
+  char path[64];
+  ssize_t n;
+  char *base;
+
+  if (XGetWindowProperty(display, win, net_wm_pid_atom, 0, 1, False,
+			 XA_CARDINAL, &type, &form, &len, &remain,
+			 &list) != Success) {
+    return;
+  }
+  if (list == NULL) {
+    return;
+  }
+  if (len < 1 || form != 32) {
+    XFree(list);
+    return;
+  }
+  pid = *(unsigned long *)list;
+  XFree(list);
+
+  snprintf(path, sizeof(path), "/proc/%lu/comm", pid);
+  if (read_proc_string(path, comm, PATH_MAX)) {
+    info->comm = comm;
+  }
+  snprintf(path, sizeof(path), "/proc/%lu/exe", pid);
+  n = readlink(path, exe, PATH_MAX-1);
+  if (n > 0) {
+    exe[n] = '\0';
+    base = strrchr(exe, '/');
+    info->exe = base ? base+1 : exe;
+  }
+}
+
 static Window last_focused_window = 0;
 static translation *last_window_translation = NULL;
 
+// Only a change of focus goes to the X server for window properties,
+// reads the config file and allocates memory.  An event for the same
+// window as the last one allocates nothing, which the replay check
+// built with COUNT_ALLOCS holds us to.
 translation *
 get_focused_window_translation()
 {
   Window focus;
+  Window named_win = 0;
   int revert_to;
   char *window_name = NULL;
   char *name;
+  XClassHint class_hint = { NULL, NULL };
+  window_info info = { NULL, NULL, NULL, NULL, NULL };
+  char comm[PATH_MAX];
+  char exe[PATH_MAX];
 
-  XGetInputFocus(display, &focus, &revert_to);
-  if (focus != last_focused_window) {
+  if (display != NULL) {
+    XGetInputFocus(display, &focus, &revert_to);
+  } else {
+    focus = replay_window;
+  }
+  focus_changed = focus != last_focused_window;
+  trace_point(TRACE_FOCUS, (int)focus, focus_changed, 0, 0);
+  if (focus_changed) {
+    stat_add(STAT_FOCUS_CHANGES, 1);
     last_focused_window = focus;
-    window_name = walk_window_tree(focus);
-    if (window_name == NULL) {
+    read_config_file();
+    if (display == NULL) {
+      name = replay_title != NULL ? replay_title : "-- Unlabeled Window --";
+    } else if ((window_name = walk_window_tree(focus, &named_win)) == NULL) {
       name = "-- Unlabeled Window --";
     } else {
       name = window_name;
     }
-    last_window_translation = get_translation(name);
+    info.title = name;
+    if (display != NULL && named_win == 0 &&
+	(have_class_sections || have_exe_sections)) {
+      named_win = walk_to_application_window(focus);
+    }
+    if (named_win != 0) {
+      if (have_class_sections && XGetClassHint(display, named_win, &class_hint)) {
+	info.instance = class_hint.res_name;
+	info.class = class_hint.res_class;
+      }
+      if (have_exe_sections) {
+	get_window_process(named_win, &info, comm, exe);
+      }
+    }
+    last_window_translation = get_window_translation(&info);
+    trace_section(last_window_translation);
     if (debug_regex) {
       if (last_window_translation != NULL) {
-	printf("translation: %s for %s\n", last_window_translation->name, name);
+	printf("translation: %s for %s", last_window_translation->name, name);
       } else {
-	printf("no translation found for %s\n", name);
+	printf("no translation found for %s", name);
+      }
+      if (info.instance != NULL || info.class != NULL) {
+	printf(" (class %s/%s)", info.instance ? info.instance : "",
+	       info.class ? info.class : "");
       }
+      if (info.comm != NULL || info.exe != NULL) {
+	printf(" (exe %s/%s)", info.comm ? info.comm : "",
+	       info.exe ? info.exe : "");
+      }
+      printf("\ntitle cache: %lu hits, %lu misses\n",
+	     stat_get(STAT_TITLE_CACHE_HITS), stat_get(STAT_TITLE_CACHE_MISSES));
+    }
+    if (class_hint.res_name != NULL) {
+      XFree(class_hint.res_name);
+    }
+    if (class_hint.res_class != NULL) {
+      XFree(class_hint.res_class);
     }
     if (window_name != NULL) {
       XFree(window_name);
@@ -265,18 +1078,23 @@ get_focused_window_translation()
 void
 handle_event(EV ev)
 {
-  translation *tr = get_focused_window_translation();
-  
-  //fprintf(stderr, "event: (%d, %d, 0x%x)\n", ev.type, ev.code, ev.value);
+  unsigned long strokes = stat_get(STAT_STROKES);
+  translation *tr;
+
+  trace_event(&ev);
+  tr = get_focused_window_translation();
+  event_time = ev.time;
   if (tr != NULL) {
     switch (ev.type) {
     case EVENT_TYPE_DONE:
     case EVENT_TYPE_ACTIVE_KEY:
       break;
     case EVENT_TYPE_KEY:
+      stat_add(STAT_KEY_EVENTS, 1);
       key(ev.code, ev.value, tr);
       break;
     case EVENT_TYPE_JOGSHUTTLE:
+      stat_add(ev.code == EVENT_CODE_JOG ? STAT_JOG_EVENTS : STAT_SHUTTLE_EVENTS, 1);
       jogshuttle(ev.code, ev.value, tr);
       break;
     default:
@@ -284,57 +1102,213 @@ handle_event(EV ev)
       break;
     }
   }
+  trace_event_done(&ev, stat_get(STAT_STROKES) - strokes);
 }
 
 
+// Backpressure.  When output falls behind, events pile up in the
+// reader's ring.  All of them are taken in one batch, and unless
+// NO_COALESCE is set, runs of jog events are merged into the last one.
+// Jog values are positions, so that keeps the net movement, and jog()
+// sends no more than JOG_MAX_STEPS of it.  Runs of shuttle events are
+// replaced by the last position.  With EVENT_DEADLINE, jog events
+// queued for longer than that only move the jog position along.
+#define MAX_BATCH 256
+
+// take the queued events, merging where allowed, with the number of
+// events merged into each in reports.  returns the count.
 int
-main(int argc, char **argv)
+take_event_batch(EV *batch, int *reports, int max)
 {
   EV ev;
-  int nread;
+  int count = 0;
+
+  while (count < max && next_event(&ev)) {
+    if (!settings.no_coalesce && count > 0 &&
+	ev.type == EVENT_TYPE_JOGSHUTTLE &&
+	batch[count-1].type == EVENT_TYPE_JOGSHUTTLE &&
+	batch[count-1].code == ev.code) {
+      stat_add(ev.code == EVENT_CODE_JOG ? STAT_JOG_MERGED : STAT_SHUTTLE_SUPERSEDED, 1);
+      batch[count-1] = ev;
+      reports[count-1]++;
+      continue;
+    }
+    reports[count] = 1;
+    batch[count++] = ev;
+  }
+  return count;
+}
+
+void
+handle_batch(EV *batch, int *reports, int count)
+{
+  long long now = now_ms();
+  unsigned long before = stat_get(STAT_JOG_MERGED) +
+    stat_get(STAT_SHUTTLE_SUPERSEDED) + stat_get(STAT_JOG_EXPIRED) +
+    stat_get(STAT_JOG_STEPS_CAPPED);
+  int i;
+#ifdef COUNT_ALLOCS
+  unsigned long allocs;
+#endif
+
+  for (i=0; i<count; i++) {
+    event_expired = settings.event_deadline > 0 &&
+      batch[i].type == EVENT_TYPE_JOGSHUTTLE && batch[i].code == EVENT_CODE_JOG &&
+      now - (batch[i].time.tv_sec * 1000LL + batch[i].time.tv_usec / 1000) >
+      settings.event_deadline;
+    event_reports = reports[i];
+#ifdef COUNT_ALLOCS
+    allocs = alloc_count;
+#endif
+    handle_event(batch[i]);
+#ifdef COUNT_ALLOCS
+    if (!focus_changed && alloc_count != allocs) {
+      fprintf(stderr, "event (%d, %d, %d) made %lu allocations with unchanged focus\n",
+	      batch[i].type, batch[i].code, batch[i].value, alloc_count - allocs);
+    }
+#endif
+  }
+  event_expired = 0;
+  event_reports = 1;
+  if (settings.debug_events &&
+      stat_get(STAT_JOG_MERGED) + stat_get(STAT_SHUTTLE_SUPERSEDED) +
+      stat_get(STAT_JOG_EXPIRED) + stat_get(STAT_JOG_STEPS_CAPPED) != before) {
+    printf("events: %lu jog merged, %lu shuttle superseded, %lu jog expired,"
+	   " %lu jog steps capped\n",
+	   stat_get(STAT_JOG_MERGED), stat_get(STAT_SHUTTLE_SUPERSEDED),
+	   stat_get(STAT_JOG_EXPIRED), stat_get(STAT_JOG_STEPS_CAPPED));
+  }
+}
+
+
+static volatile sig_atomic_t stop_requested = 0;
+
+// SIGTERM and SIGINT stop the main loop, which then calls exit(), so
+// the atexit() handlers run
+void
+request_stop(int sig)
+{
+  stop_requested = sig;
+  wake_from_signal();
+}
+
+void
+catch_stop_signals(void)
+{
+  struct sigaction sa;
+
+  // without SA_RESTART, so that sleep() returns as well as poll()
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = request_stop;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+}
+
+// combine two poll() timeouts, where -1 means none
+int
+earliest_timeout(int a, int b)
+{
+  if (a < 0 || (b >= 0 && b < a)) {
+    return b;
+  }
+  return a;
+}
+
+int
+main(int argc, char **argv)
+{
+  EV batch[MAX_BATCH];
+  int reports[MAX_BATCH];
+  int count;
   char *dev_name;
   int fd;
   int first_time = 1;
+  struct pollfd pfd;
+  int timeout;
+
+  clock_gettime(CLOCK_MONOTONIC, &profile_start);
+  profile_last = profile_start;
 
+  if (argc == 3 && !strcmp(argv[1], "--profile-startup")) {
+    profile_startup = 1;
+    argc--;
+    argv++;
+  }
+  start_stats();
+  start_trace();
+  if (argc >= 3 && !strcmp(argv[1], "--replay")) {
+    config_reload_hook = before_config_reload;
+    exit(replay_traces(argc-2, argv+2) ? 0 : 1);
+  }
   if (argc != 2) {
-    fprintf(stderr, "usage: shuttlepro <device>\n" );
+    fprintf(stderr, "usage: shuttlepro [--profile-startup] <device>\n"
+	    "       shuttlepro --replay [-n COUNT] <trace>...\n");
     exit(1);
   }
 
   dev_name = argv[1];
+  catch_stop_signals();
 
   initdisplay();
 
-  while (1) {
+  // load the config now rather than on the first event
+  config_reload_hook = before_config_reload;
+  read_config_file();
+  profile_phase("read_config_file");
+
+  while (!stop_requested) {
     fd = open(dev_name, O_RDONLY);
+    profile_phase("open");
     if (fd < 0) {
       perror(dev_name);
       if (first_time) {
 	exit(1);
       }
     } else {
-      // Flag it as exclusive access
-      if(ioctl( fd, EVIOCGRAB, 1 ) < 0) {
+      // Flag it as exclusive access.  hidraw devices can't be grabbed.
+      hidraw_device = is_hidraw(fd);
+      if (hidraw_device < 0) {
+	exit(1);
+      }
+      if (!hidraw_device && ioctl( fd, EVIOCGRAB, 1 ) < 0) {
 	perror( "evgrab ioctl" );
+	if (profile_startup) {
+	  exit(1);
+	}
       } else {
+	profile_phase(hidraw_device ? "hidraw" : "EVIOCGRAB");
+	profile_ready();
 	first_time = 0;
-	while (1) {
-	  nread = read(fd, &ev, sizeof(ev));
-	  if (nread == sizeof(ev)) {
-	    handle_event(ev);
-	  } else {
-	    if (nread < 0) {
-	      perror("read event");
-	      break;
-	    } else {
-	      fprintf(stderr, "short read: %d\n", nread);
-	      break;
+	pfd.fd = start_reader(fd);
+	pfd.events = POLLIN;
+	while (pfd.fd >= 0 && !stop_requested) {
+	  check_trace_dump();
+	  timeout = earliest_timeout(run_gestures(), run_timed_macros());
+	  timeout = earliest_timeout(timeout, run_smooth_scroll());
+	  if (poll(&pfd, 1, timeout) < 0) {
+	    if (errno == EINTR) {
+	      continue;
 	    }
+	    perror("poll");
+	    break;
+	  }
+	  if (pfd.revents == 0) {
+	    continue;
+	  }
+	  while ((count = take_event_batch(batch, reports, MAX_BATCH)) > 0) {
+	    handle_batch(batch, reports, count);
+	  }
+	  if (reader_stopped()) {
+	    break;
 	  }
 	}
       }
     }
     close(fd);
-    sleep(1);
+    if (!stop_requested) {
+      sleep(1);
+    }
   }
+  exit(0);
 }
@@ -0,0 +1,363 @@
+/*
+
+ Virtual ShuttlePRO v2 for load testing
+
+ Copyright 2013 Eric Messick (FixedImagePhoto.com/Contact)
+
+ Creates a device which looks like a Contour Design ShuttlePRO v2 and
+ plays scripted patterns on it, so shuttlepro can be run and measured
+ without anyone turning the wheels.
+
+ usage: shuttlesim [-U] [-r RATE] [-n COUNT] [-w SECONDS] PATTERN...
+
+ By default the device is made through /dev/uinput, and shows up as an
+ event device with the same name as the real one, so the udev rule and
+ the shuttle script find it.  With -U it's made through /dev/uhid
+ instead, and sends the real device's HID reports, which also gives a
+ /dev/hidrawN for shuttlepro's hidraw backend.
+
+ The patterns are played in order, each at RATE steps per second
+ (default 100):
+
+ jog      COUNT jog detents clockwise
+ jogback  COUNT jog detents counter-clockwise
+ wrap     COUNT spins of 8 detents back and forth through jog value 0
+ shuttle  COUNT sweeps of the shuttle out to 7 and back, alternating
+          sides, ending at rest
+ keys     COUNT taps of random keys, press and release each a step
+
+ COUNT defaults to 1000.  The device is created, then after SECONDS
+ (default 1) to let udev and shuttlepro open it, the patterns are
+ played, and the device is removed after another SECONDS.  The number
+ of steps sent and the rate achieved are printed for each pattern.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include <linux/input.h>
+#include <linux/uinput.h>
+#include <linux/uhid.h>
+
+#define DEVICE_NAME "Contour Design ShuttlePRO v2"
+#define SHUTTLE_VENDOR 0x0b33
+#define SHUTTLEPRO_V2_PRODUCT 0x0030
+
+#define NUM_KEYS 15
+#define FIRST_KEY BTN_0 // K1, the codes shuttlepro expects from 256 up
+
+// the device's report: shuttle as a signed byte, the jog counter, an
+// unused byte, and 15 buttons
+static unsigned char report_descriptor[] = {
+  0x05, 0x0c,		// Usage Page (Consumer)
+  0x09, 0x01,		// Usage (Consumer Control)
+  0xa1, 0x01,		// Collection (Application)
+  0x05, 0x01,		//   Usage Page (Generic Desktop)
+  0x09, 0x38,		//   Usage (Wheel), the shuttle
+  0x15, 0xf9,		//   Logical Minimum (-7)
+  0x25, 0x07,		//   Logical Maximum (7)
+  0x75, 0x08,		//   Report Size (8)
+  0x95, 0x01,		//   Report Count (1)
+  0x81, 0x06,		//   Input (Data, Variable, Relative)
+  0x09, 0x37,		//   Usage (Dial), the jog wheel
+  0x15, 0x00,		//   Logical Minimum (0)
+  0x26, 0xff, 0x00,	//   Logical Maximum (255)
+  0x81, 0x06,		//   Input (Data, Variable, Relative)
+  0x81, 0x01,		//   Input (Constant), unused byte
+  0x05, 0x09,		//   Usage Page (Button)
+  0x19, 0x01,		//   Usage Minimum (1)
+  0x29, 0x0f,		//   Usage Maximum (15)
+  0x25, 0x01,		//   Logical Maximum (1)
+  0x75, 0x01,		//   Report Size (1)
+  0x95, 0x0f,		//   Report Count (15)
+  0x81, 0x02,		//   Input (Data, Variable, Absolute)
+  0x95, 0x01,		//   Report Count (1)
+  0x81, 0x01,		//   Input (Constant), padding
+  0xc0			// End Collection
+};
+
+typedef struct _device_state {
+  int shuttle; // -7 .. 7
+  int jog; // 0 .. 255
+  unsigned int buttons; // bit k for K<k+1>
+} device_state;
+
+static int use_uhid = 0;
+static int device_fd = -1;
+static device_state sent; // what the device last reported
+static device_state state; // what the pattern wants next
+
+void
+fail(char *what)
+{
+  perror(what);
+  exit(1);
+}
+
+void
+write_all(void *data, size_t len)
+{
+  if (write(device_fd, data, len) != (ssize_t)len) {
+    fail(use_uhid ? "uhid write" : "uinput write");
+  }
+}
+
+void
+emit(int type, int code, int value)
+{
+  struct input_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.type = type;
+  ev.code = code;
+  ev.value = value;
+  write_all(&ev, sizeof(ev));
+}
+
+void
+create_uinput_device(void)
+{
+  struct uinput_setup setup;
+  int k;
+
+  device_fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+  if (device_fd < 0) {
+    fail("/dev/uinput");
+  }
+  if (ioctl(device_fd, UI_SET_EVBIT, EV_KEY) < 0 ||
+      ioctl(device_fd, UI_SET_EVBIT, EV_REL) < 0 ||
+      ioctl(device_fd, UI_SET_RELBIT, REL_DIAL) < 0 ||
+      ioctl(device_fd, UI_SET_RELBIT, REL_WHEEL) < 0) {
+    fail("uinput setup");
+  }
+  for (k=0; k<NUM_KEYS; k++) {
+    if (ioctl(device_fd, UI_SET_KEYBIT, FIRST_KEY + k) < 0) {
+      fail("uinput setup");
+    }
+  }
+  memset(&setup, 0, sizeof(setup));
+  setup.id.bustype = BUS_USB;
+  setup.id.vendor = SHUTTLE_VENDOR;
+  setup.id.product = SHUTTLEPRO_V2_PRODUCT;
+  strcpy(setup.name, DEVICE_NAME);
+  if (ioctl(device_fd, UI_DEV_SETUP, &setup) < 0 ||
+      ioctl(device_fd, UI_DEV_CREATE) < 0) {
+    fail("uinput create");
+  }
+}
+
+void
+create_uhid_device(void)
+{
+  struct uhid_event ev;
+
+  device_fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+  if (device_fd < 0) {
+    fail("/dev/uhid");
+  }
+  memset(&ev, 0, sizeof(ev));
+  ev.type = UHID_CREATE2;
+  strcpy((char *)ev.u.create2.name, DEVICE_NAME);
+  memcpy(ev.u.create2.rd_data, report_descriptor, sizeof(report_descriptor));
+  ev.u.create2.rd_size = sizeof(report_descriptor);
+  ev.u.create2.bus = BUS_USB;
+  ev.u.create2.vendor = SHUTTLE_VENDOR;
+  ev.u.create2.product = SHUTTLEPRO_V2_PRODUCT;
+  write_all(&ev, sizeof(ev));
+}
+
+void
+destroy_device(void)
+{
+  struct uhid_event ev;
+
+  if (use_uhid) {
+    memset(&ev, 0, sizeof(ev));
+    ev.type = UHID_DESTROY;
+    write_all(&ev, sizeof(ev));
+  } else {
+    ioctl(device_fd, UI_DEV_DESTROY);
+  }
+  close(device_fd);
+}
+
+// report whatever changed in state since the last report.  Through
+// uinput, the input layer drops the jog and shuttle values of 0 just as
+// it does for the real device.
+void
+send_state(void)
+{
+  struct uhid_event ev;
+  unsigned int changed = state.buttons ^ sent.buttons;
+  int k;
+
+  if (use_uhid) {
+    memset(&ev, 0, sizeof(ev));
+    ev.type = UHID_INPUT2;
+    ev.u.input2.size = 5;
+    ev.u.input2.data[0] = (unsigned char)(signed char)state.shuttle;
+    ev.u.input2.data[1] = state.jog;
+    ev.u.input2.data[3] = state.buttons & 0xff;
+    ev.u.input2.data[4] = state.buttons >> 8;
+    write_all(&ev, sizeof(ev));
+  } else {
+    for (k=0; k<NUM_KEYS; k++) {
+      if (changed & (1 << k)) {
+	emit(EV_KEY, FIRST_KEY + k, (state.buttons >> k) & 1);
+      }
+    }
+    if (state.shuttle != sent.shuttle) {
+      emit(EV_REL, REL_WHEEL, state.shuttle);
+    }
+    if (state.jog != sent.jog) {
+      emit(EV_REL, REL_DIAL, state.jog);
+    }
+    emit(EV_SYN, SYN_REPORT, 0);
+  }
+  sent = state;
+}
+
+// pacing of the steps
+static struct timespec next_step;
+static long step_ns;
+static long steps;
+
+void
+step(void)
+{
+  send_state();
+  steps++;
+  next_step.tv_nsec += step_ns;
+  while (next_step.tv_nsec >= 1000000000) {
+    next_step.tv_nsec -= 1000000000;
+    next_step.tv_sec++;
+  }
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_step, NULL) == EINTR) {
+  }
+}
+
+void
+jog_by(int detents)
+{
+  int direction = detents < 0 ? -1 : 1;
+
+  while (detents != 0) {
+    state.jog = (state.jog + direction) & 0xff;
+    step();
+    detents -= direction;
+  }
+}
+
+void
+play(char *pattern, long count)
+{
+  struct timespec start, end;
+  double seconds;
+  long i;
+  int v, k;
+
+  steps = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  next_step = start;
+  if (!strcmp(pattern, "jog")) {
+    jog_by(count);
+  } else if (!strcmp(pattern, "jogback")) {
+    jog_by(-count);
+  } else if (!strcmp(pattern, "wrap")) {
+    // start 4 detents before 0, so each spin crosses it
+    jog_by((256 + 252 - state.jog) % 256);
+    for (i=0; i<count; i++) {
+      jog_by(i % 2 ? -8 : 8);
+    }
+  } else if (!strcmp(pattern, "shuttle")) {
+    for (i=0; i<count; i++) {
+      for (v=1; v<=7; v++) {
+	state.shuttle = i % 2 ? -v : v;
+	step();
+      }
+      for (v=6; v>=0; v--) {
+	state.shuttle = i % 2 ? -v : v;
+	step();
+      }
+    }
+  } else if (!strcmp(pattern, "keys")) {
+    for (i=0; i<count; i++) {
+      k = rand() % NUM_KEYS;
+      state.buttons |= 1 << k;
+      step();
+      state.buttons &= ~(1 << k);
+      step();
+    }
+  } else {
+    fprintf(stderr, "unknown pattern: %s\n", pattern);
+    exit(1);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+  printf("%-8s %8ld steps %10.3f s %10.1f steps/s\n", pattern, steps, seconds,
+	 seconds > 0 ? steps / seconds : 0.0);
+  fflush(stdout);
+}
+
+void
+usage(void)
+{
+  fprintf(stderr, "usage: shuttlesim [-U] [-r RATE] [-n COUNT] [-w SECONDS] PATTERN...\n"
+	  "patterns: jog jogback wrap shuttle keys\n");
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  double rate = 100;
+  long count = 1000;
+  int wait = 1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "Ur:n:w:")) != -1) {
+    switch (opt) {
+    case 'U':
+      use_uhid = 1;
+      break;
+    case 'r':
+      rate = atof(optarg);
+      break;
+    case 'n':
+      count = atol(optarg);
+      break;
+    case 'w':
+      wait = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind >= argc || rate <= 0 || count <= 0 || wait < 0) {
+    usage();
+  }
+  step_ns = 1e9 / rate;
+
+  if (use_uhid) {
+    create_uhid_device();
+  } else {
+    create_uinput_device();
+  }
+  // the real device starts with the jog counter somewhere arbitrary
+  state.jog = sent.jog = 17;
+  sleep(wait);
+  send_state();
+  for (; optind<argc; optind++) {
+    play(argv[optind], count);
+  }
+  sleep(wait);
+  destroy_device();
+  return 0;
+}
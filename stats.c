@@ -0,0 +1,170 @@
+/*
+
+  Copyright 2013 Eric Messick (FixedImagePhoto.com/Contact)
+
+  Statistics
+
+  Counters and gauges for what shuttlepro has been doing, kept in the
+  stats array declared in shuttle.h.  The event path only does relaxed
+  loads and stores on them.
+
+  If SHUTTLE_STATS_FILE is set, a thread of its own writes them there
+  every SHUTTLE_STATS_INTERVAL seconds (default 15), and once more at
+  exit, including when stopped by SIGTERM or SIGINT, in the Prometheus
+  text format.  Point it into the node
+  exporter's textfile collector directory, with a name ending in
+  .prom.  Each write goes to a temporary file which is renamed over
+  the old one, so the collector never sees half a file.  There's no
+  listening socket, and the event thread does no file I/O for it.
+
+ */
+
+#include "shuttle.h"
+
+#include <pthread.h>
+#include <signal.h>
+
+#define DEFAULT_STATS_INTERVAL 15 // seconds
+
+atomic_ulong stats[NUM_STATS];
+
+typedef struct _stat_info {
+  char *name;
+  char *labels; // NULL for none
+  char *type;
+  char *help;
+} stat_info;
+
+// in STAT_ order.  Entries sharing a name are written together, under
+// one HELP and TYPE.
+static stat_info stat_infos[NUM_STATS] = {
+  { "shuttlepro_events_total", "type=\"key\"", "counter",
+    "Events handled, by type." },
+  { "shuttlepro_events_total", "type=\"jog\"", "counter", NULL },
+  { "shuttlepro_events_total", "type=\"shuttle\"", "counter", NULL },
+  { "shuttlepro_strokes_total", NULL, "counter",
+    "Key and button strokes sent." },
+  { "shuttlepro_xtest_requests_total", NULL, "counter",
+    "XTest fake input requests made." },
+  { "shuttlepro_flushes_total", NULL, "counter",
+    "Flushes of the X output buffer." },
+  { "shuttlepro_focus_changes_total", NULL, "counter",
+    "Events which found a different window focused." },
+  { "shuttlepro_title_cache_hits_total", NULL, "counter",
+    "Window titles found in the translation cache." },
+  { "shuttlepro_title_cache_misses_total", NULL, "counter",
+    "Window titles which had to be matched against the sections." },
+  { "shuttlepro_regex_evaluations_total", NULL, "counter",
+    "Section regexes run against a window title." },
+  { "shuttlepro_reloads_total", NULL, "counter",
+    "Loads of the config file." },
+  { "shuttlepro_parse_errors_total", NULL, "counter",
+    "Errors found in the config file." },
+  { "shuttlepro_events_dropped_total", NULL, "counter",
+    "Jog and shuttle events replaced by a later one while the "
+    "reader's queue was full." },
+  { "shuttlepro_jog_merged_total", NULL, "counter",
+    "Queued jog events merged into a later one." },
+  { "shuttlepro_shuttle_superseded_total", NULL, "counter",
+    "Queued shuttle events replaced by a later one." },
+  { "shuttlepro_jog_expired_total", NULL, "counter",
+    "Jog events queued past EVENT_DEADLINE." },
+  { "shuttlepro_jog_steps_capped_total", NULL, "counter",
+    "Jog steps not sent because an event moved more than JOG_MAX_STEPS." },
+  { "shuttlepro_sections", NULL, "gauge",
+    "Sections in the loaded config." },
+  { "shuttlepro_compiled_regexes", NULL, "gauge",
+    "Section regexes currently compiled." },
+};
+
+static char *stats_file_name = NULL;
+static char *stats_temp_name = NULL;
+static int stats_interval = DEFAULT_STATS_INTERVAL;
+static time_t start_time;
+static pthread_t stats_thread;
+static pthread_mutex_t stats_file_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// without stdio, so the event thread's allocations aren't disturbed
+void
+write_stats(void)
+{
+  char buf[8192];
+  int len = 0;
+  int fd;
+  int i;
+
+  for (i=0; i<NUM_STATS; i++) {
+    if (i == 0 || strcmp(stat_infos[i].name, stat_infos[i-1].name)) {
+      len += snprintf(buf + len, sizeof(buf) - len, "# HELP %s %s\n# TYPE %s %s\n",
+		      stat_infos[i].name, stat_infos[i].help,
+		      stat_infos[i].name, stat_infos[i].type);
+    }
+    len += snprintf(buf + len, sizeof(buf) - len, "%s%s%s%s %lu\n",
+		    stat_infos[i].name, stat_infos[i].labels ? "{" : "",
+		    stat_infos[i].labels ? stat_infos[i].labels : "",
+		    stat_infos[i].labels ? "}" : "", stat_get(i));
+  }
+  len += snprintf(buf + len, sizeof(buf) - len,
+		  "# HELP shuttlepro_start_time_seconds When shuttlepro started.\n"
+		  "# TYPE shuttlepro_start_time_seconds gauge\n"
+		  "shuttlepro_start_time_seconds %ld\n", (long)start_time);
+
+  // the last write, from exit(), can come while the thread is writing
+  pthread_mutex_lock(&stats_file_lock);
+  fd = open(stats_temp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(stats_temp_name);
+  } else if (write(fd, buf, len) != len) {
+    perror(stats_temp_name);
+    close(fd);
+    unlink(stats_temp_name);
+  } else {
+    close(fd);
+    if (rename(stats_temp_name, stats_file_name) < 0) {
+      perror(stats_file_name);
+      unlink(stats_temp_name);
+    }
+  }
+  pthread_mutex_unlock(&stats_file_lock);
+}
+
+void *
+stats_writer(void *arg)
+{
+  (void)arg;
+  while (1) {
+    sleep(stats_interval);
+    write_stats();
+  }
+  return NULL;
+}
+
+// start writing the stats out, if SHUTTLE_STATS_FILE asks for it
+void
+start_stats(void)
+{
+  char *interval;
+  sigset_t all, old;
+
+  stats_file_name = getenv("SHUTTLE_STATS_FILE");
+  if (stats_file_name == NULL || *stats_file_name == '\0') {
+    return;
+  }
+  interval = getenv("SHUTTLE_STATS_INTERVAL");
+  if (interval != NULL && atoi(interval) > 0) {
+    stats_interval = atoi(interval);
+  }
+  // not ending in .prom, so the collector ignores it
+  stats_temp_name = alloc_strcat(stats_file_name, ".tmp");
+  start_time = time(NULL);
+  write_stats();
+  atexit(write_stats);
+
+  // signals are for the main thread
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  if (pthread_create(&stats_thread, NULL, stats_writer, NULL) != 0) {
+    fprintf(stderr, "can't start stats thread\n");
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
@@ -0,0 +1,223 @@
+/*
+
+  Copyright 2013 Eric Messick (FixedImagePhoto.com/Contact)
+
+  Hot path trace
+
+  The main thread records what it does with each event in a ring of
+  the last TRACE_SIZE trace entries, with nanosecond timestamps: the
+  event as it's handled, the window found focused, the section chosen,
+  the strokes sent, and each flush of the X output.  Recording one is
+  a few stores, without printing or allocating, so it's always on.
+  The CPU's time stamp counter, where there is one, or else the clock,
+  is read when an event comes in, and the focus and section entries
+  made while handling it share that time.  The strokes entry ending
+  the event and each flush read the counter again, so how long an
+  event took shows as the delta of its strokes entry.  Counter ticks
+  are made into ns when the ring is dumped, at the rate the counter
+  has run at since startup.
+
+  The ring is written out, oldest entry first, to SHUTTLE_TRACE_FILE
+  (default /tmp/shuttlepro-PID.trace) when the process gets SIGUSR2,
+  or when an event takes longer than TRACE_THRESHOLD ms from the
+  device to the end of its handling.  After the first dump, a threshold
+  dump waits until the ring has filled up again, so a run of slow
+  events doesn't keep rewriting the file.  Each line of the file is
+
+  ns +delta kind details
+
+  where ns is on the CLOCK_MONOTONIC clock, and delta is the time
+  since the entry before.
+
+ */
+
+#include "shuttle.h"
+
+#include <signal.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define trace_clock() ((long long)__rdtsc())
+#else
+#define trace_clock() now_ns()
+#endif
+
+#define TRACE_SIZE 4096 // a power of two
+
+static trace_entry trace_ring[TRACE_SIZE];
+static unsigned long trace_count = 0; // entries ever recorded
+static unsigned long last_dump_count = 0;
+static int have_dumped = 0;
+static char *trace_file_name = NULL;
+static volatile sig_atomic_t dump_requested = 0;
+static long long start_ticks, start_ns; // for converting ticks to ns
+static long long event_ticks; // when the event being handled started
+static int in_event = 0;
+
+static char *trace_kinds[] = { "?", "event", "focus", "section", "strokes", "flush" };
+
+void
+trace_point(int kind, int a, int b, int c, int d)
+{
+  trace_entry *t = &trace_ring[trace_count++ & (TRACE_SIZE - 1)];
+
+  // the end of an event, and flushes, take their own time
+  t->ticks = in_event && kind != TRACE_STROKES && kind != TRACE_FLUSH ?
+    event_ticks : trace_clock();
+  t->kind = kind;
+  t->u.args[0] = a;
+  t->u.args[1] = b;
+  t->u.args[2] = c;
+  t->u.args[3] = d;
+}
+
+void
+trace_section(translation *tr)
+{
+  trace_entry *t = &trace_ring[trace_count & (TRACE_SIZE - 1)];
+
+  trace_point(TRACE_SECTION, 0, 0, 0, 0);
+  if (tr != NULL) {
+    strncpy(t->u.name, tr->name, TRACE_NAME_LEN);
+  } else {
+    t->u.name[0] = '\0';
+  }
+}
+
+// usec from when ev happened until now
+int
+event_age(struct input_event *ev)
+{
+  return now_ns() / 1000 - (ev->time.tv_sec * 1000000LL + ev->time.tv_usec);
+}
+
+void
+trace_event(struct input_event *ev)
+{
+  event_ticks = trace_clock();
+  in_event = 1;
+  trace_point(TRACE_EVENT, ev->type, ev->code, ev->value,
+	      (int)(ev->time.tv_sec * 1000000LL + ev->time.tv_usec));
+}
+
+void
+dump_trace(char *why)
+{
+  char buf[8192];
+  int len = 0;
+  unsigned long first;
+  unsigned long i;
+  long long ns, prev_ns;
+  double ns_per_tick = 1;
+  long long ticks;
+  trace_entry *t;
+  int fd;
+
+  fd = open(trace_file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(trace_file_name);
+    return;
+  }
+  ticks = trace_clock();
+  if (ticks > start_ticks) {
+    ns_per_tick = (double)(now_ns() - start_ns) / (ticks - start_ticks);
+  }
+  first = trace_count > TRACE_SIZE ? trace_count - TRACE_SIZE : 0;
+  prev_ns = start_ns + (trace_ring[first & (TRACE_SIZE - 1)].ticks - start_ticks) * ns_per_tick;
+  len = snprintf(buf, sizeof(buf), "# shuttlepro trace, %lu entries, dumped for %s\n",
+		 trace_count - first, why);
+  for (i=first; i<trace_count; i++) {
+    t = &trace_ring[i & (TRACE_SIZE - 1)];
+    ns = start_ns + (t->ticks - start_ticks) * ns_per_tick;
+    len += snprintf(buf + len, sizeof(buf) - len, "%lld +%lld %s", ns,
+		    ns - prev_ns, trace_kinds[t->kind]);
+    switch (t->kind) {
+    case TRACE_EVENT:
+      len += snprintf(buf + len, sizeof(buf) - len, " (%d, %d, %d) %d usec old",
+		      t->u.args[0], t->u.args[1], t->u.args[2],
+		      (int)((unsigned int)(ns / 1000) - (unsigned int)t->u.args[3]));
+      break;
+    case TRACE_FOCUS:
+      len += snprintf(buf + len, sizeof(buf) - len, " 0x%x%s", t->u.args[0],
+		      t->u.args[1] ? " changed" : "");
+      break;
+    case TRACE_SECTION:
+      len += snprintf(buf + len, sizeof(buf) - len, " [%.*s]", TRACE_NAME_LEN,
+		      t->u.name);
+      break;
+    case TRACE_STROKES:
+      len += snprintf(buf + len, sizeof(buf) - len, " %d", t->u.args[0]);
+      break;
+    }
+    buf[len++] = '\n';
+    prev_ns = ns;
+    if (len > (int)sizeof(buf) - 256 || i + 1 == trace_count) {
+      if (write(fd, buf, len) != len) {
+	perror(trace_file_name);
+	break;
+      }
+      len = 0;
+    }
+  }
+  if (len > 0 && write(fd, buf, len) != len) {
+    perror(trace_file_name);
+  }
+  close(fd);
+  last_dump_count = trace_count;
+  have_dumped = 1;
+  fprintf(stderr, "trace dumped to %s for %s\n", trace_file_name, why);
+}
+
+void
+trace_event_done(struct input_event *ev, int strokes)
+{
+  char why[64];
+  int age;
+
+  trace_point(TRACE_STROKES, strokes, 0, 0, 0);
+  in_event = 0;
+  if (settings.trace_threshold > 0 &&
+      (!have_dumped || trace_count - last_dump_count >= TRACE_SIZE) &&
+      (age = event_age(ev)) > settings.trace_threshold * 1000) {
+    snprintf(why, sizeof(why), "an event handled after %d usec", age);
+    dump_trace(why);
+  }
+}
+
+// called from the top of the main loop, which SIGUSR2 wakes up
+void
+check_trace_dump(void)
+{
+  if (dump_requested) {
+    dump_requested = 0;
+    dump_trace("SIGUSR2");
+  }
+}
+
+void
+request_trace_dump(int sig)
+{
+  (void)sig;
+  dump_requested = 1;
+  // in case it came after the main loop looked, but before poll()
+  wake_from_signal();
+}
+
+void
+start_trace(void)
+{
+  struct sigaction sa;
+  char name[64];
+
+  trace_file_name = getenv("SHUTTLE_TRACE_FILE");
+  if (trace_file_name == NULL || *trace_file_name == '\0') {
+    snprintf(name, sizeof(name), "/tmp/shuttlepro-%d.trace", (int)getpid());
+    trace_file_name = alloc_strcat(name, NULL);
+  }
+  start_ns = now_ns();
+  start_ticks = trace_clock();
+  // without SA_RESTART, so that poll() returns
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = request_trace_dump;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR2, &sa, NULL);
+}
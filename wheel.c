@@ -0,0 +1,108 @@
+/*
+
+  Copyright 2013 Eric Messick (FixedImagePhoto.com/Contact)
+
+  High resolution scroll wheel
+
+  XTest can only scroll by pressing buttons 4 and 5, one whole wheel
+  detent at a time.  For scroll= on a shuttle position, the program
+  instead makes a virtual wheel mouse through /dev/uinput, and sends
+  REL_WHEEL_HI_RES on it in fractions of a detent, the way a
+  free-spinning mouse wheel does.  The X server picks it up like any
+  other mouse, and libinput passes the fractions on as smooth scroll
+  events to programs which use XI2.  A plain REL_WHEEL is sent as well
+  each time a whole detent has gone by, for those which don't.
+
+  The device is made the first time a scroll= position is used.  If
+  /dev/uinput can't be opened, scrolling falls back to button clicks.
+
+ */
+
+#include "shuttle.h"
+
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+
+#ifndef REL_WHEEL_HI_RES
+#define REL_WHEEL_HI_RES 0x0b
+#endif
+
+#define WHEEL_DEVICE_NAME "ShuttlePRO smooth scroll"
+
+static int wheel_fd = -1;
+static int wheel_tried = 0;
+static int wheel_remainder = 0; // hi-res units since the last REL_WHEEL
+
+// returns 1 if the hi-res wheel is there to be used, making it if this
+// is the first call
+int
+open_hires_wheel(void)
+{
+  struct uinput_setup setup;
+
+  if (wheel_tried) {
+    return wheel_fd >= 0;
+  }
+  wheel_tried = 1;
+  wheel_fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+  if (wheel_fd < 0) {
+    fprintf(stderr, "/dev/uinput: %s, scrolling by wheel clicks\n", strerror(errno));
+    return 0;
+  }
+  memset(&setup, 0, sizeof(setup));
+  setup.id.bustype = BUS_VIRTUAL;
+  strcpy(setup.name, WHEEL_DEVICE_NAME);
+  // a pointer needs a button for the X server to take it as a mouse
+  if (ioctl(wheel_fd, UI_SET_EVBIT, EV_KEY) < 0 ||
+      ioctl(wheel_fd, UI_SET_KEYBIT, BTN_LEFT) < 0 ||
+      ioctl(wheel_fd, UI_SET_EVBIT, EV_REL) < 0 ||
+      ioctl(wheel_fd, UI_SET_RELBIT, REL_WHEEL) < 0 ||
+      ioctl(wheel_fd, UI_SET_RELBIT, REL_WHEEL_HI_RES) < 0 ||
+      ioctl(wheel_fd, UI_DEV_SETUP, &setup) < 0 ||
+      ioctl(wheel_fd, UI_DEV_CREATE) < 0) {
+    fprintf(stderr, "can't make a uinput wheel: %s, scrolling by wheel clicks\n",
+	    strerror(errno));
+    close(wheel_fd);
+    wheel_fd = -1;
+    return 0;
+  }
+  return 1;
+}
+
+void
+wheel_event(int type, int code, int value)
+{
+  struct input_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.type = type;
+  ev.code = code;
+  ev.value = value;
+  if (write(wheel_fd, &ev, sizeof(ev)) != sizeof(ev)) {
+    perror("uinput wheel");
+  }
+}
+
+// scroll by units of 1/WHEEL_HI_RES_UNITS detent, positive is down
+void
+send_hires_wheel(int units)
+{
+  int detents;
+
+  // the input layer has positive wheel values scrolling up
+  wheel_event(EV_REL, REL_WHEEL_HI_RES, -units);
+  wheel_remainder += units;
+  detents = wheel_remainder / WHEEL_HI_RES_UNITS;
+  if (detents != 0) {
+    wheel_event(EV_REL, REL_WHEEL, -detents);
+    wheel_remainder -= detents * WHEEL_HI_RES_UNITS;
+  }
+  wheel_event(EV_SYN, SYN_REPORT, 0);
+}
+
+// forget any part detent, when a scroll stops
+void
+reset_hires_wheel(void)
+{
+  wheel_remainder = 0;
+}